@@ -2,12 +2,14 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct kmem_cache;
 struct pipe;
 struct proc;
 struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct vma;
 
 // bio.c
 void            binit(void);
@@ -23,12 +25,15 @@ void            consoleintr(int);
 void            consputc(int);
 
 // exec.c
-int             kexec(char*, char**);
+int             kexec(struct proc*, char*, char**);
+struct inode*   cwdget(void);
 
 // file.c
 struct file*    filealloc(void);
 void            fileclose(struct file*);
 struct file*    filedup(struct file*);
+struct file*    fdget(int, int*);
+void            fdput(struct file*, int);
 void            fileinit(void);
 int             fileread(struct file*, uint64, int n);
 int             filestat(struct file*, uint64 addr);
@@ -59,6 +64,14 @@ void            ireclaim(int);
 void*           kalloc(void);
 void            kfree(void *);
 void            kinit(void);
+void*           kzalloc(void);
+int             kzero_idle(void);
+void            kref(void *);
+int             krefcount(void *);
+void*           kalloc_order(int);
+void            kfree_order(void *, int);
+void            ksplit(void *, int);
+void            kmemdump(void);
 
 // log.c
 void            initlog(int, struct superblock*);
@@ -66,7 +79,33 @@ void            log_write(struct buf*);
 void            begin_op(void);
 void            end_op(void);
 
+// mmap.c
+void            mmapinit(void);
+uint64          mmapfault(pagetable_t, uint64, int);
+int             mmapcopy(struct proc*, struct proc*);
+void            mmapexit(struct proc*);
+uint64          mmapbase(struct proc*);
+struct vma*     vmalookup(struct proc*, uint64);
+int             vmaunmap(struct proc*, uint64, uint64);
+
+// text.c
+void            textinit(void);
+uint64          textget(struct inode*, uint64, uint);
+void            textinval(struct inode*);
+void            textdump(void);
+
+// futex.c
+void            futexinit(void);
+int             futexwait(uint64, uint);
+int             futexwake(uint64, int);
+
+// timer.c
+void            timersinit(void);
+int             sleepuntil(uint64);
+uint64          timerexpire(uint64);
+
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
@@ -80,16 +119,22 @@ void            printfinit(void);
 // proc.c
 int             cpuid(void);
 void            kexit(int);
+void            ktexit(int);
 int             kfork(void);
+int             kspawn(char*, char**, struct file**);
 int             growproc(int);
-void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
-void            proc_freepagetable(pagetable_t, uint64);
+void            proc_freepagetable(pagetable_t, uint64, int);
 int             kkill(int);
+int             kclone(uint64, uint64, uint64);
+int             kjoin(int, uint64);
+int             setaffinity(int, uint64);
+int             getaffinity(int, uint64*, int*);
 int             killed(struct proc*);
 void            setkilled(struct proc*);
 struct cpu*     mycpu(void);
 struct proc*    myproc();
+uint64          procsatp(struct proc*);
 void            procinit(void);
 void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
@@ -97,6 +142,8 @@ void            sleep(void*, struct spinlock*);
 void            userinit(void);
 int             kwait(uint64);
 void            wakeup(void*);
+void            wakeup_one(void*);
+void            schedtick(void);
 void            yield(void);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
@@ -113,6 +160,13 @@ void            release(struct spinlock*);
 void            push_off(void);
 void            pop_off(void);
 
+// slab.c
+void            slabinit(void);
+struct kmem_cache* kmem_cache_create(char*, uint);
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
+void            slabdump(void);
+
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
@@ -142,6 +196,8 @@ void            trapinit(void);
 void            trapinithart(void);
 extern struct spinlock tickslock;
 void            prepare_return(void);
+void            tickresume(void);
+void            kick(int);
 
 // uart.c
 void            uartinit(void);
@@ -159,16 +215,26 @@ pagetable_t     uvmcreate(void);
 uint64          uvmalloc(pagetable_t, uint64, uint64, int);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmshare(pagetable_t, pagetable_t, uint64, uint64, int);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
 pte_t *         walk(pagetable_t, uint64, int);
 uint64          walkaddr(pagetable_t, uint64);
+uint64          uvmwriteaddr(pagetable_t, uint64);
+uint64          uvmpin(pagetable_t, uint64, uint64, int);
+void            uvmunpin(void);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
 int             ismapped(pagetable_t, uint64);
 uint64          vmfault(pagetable_t, uint64, int);
+uint64          uvmcow(pagetable_t, uint64);
+void            tlbshootdown(pagetable_t);
+void            tlbpoll(void);
+pte_t *         walklevel(pagetable_t, uint64, int, int);
+void            vmprint(char*, pagetable_t);
+void            kvmdump(void);
 
 // plic.c
 void            plicinit(void);
@@ -3,37 +3,51 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "fcntl.h"
 #include "proc.h"
 #include "defs.h"
 #include "elf.h"
 
-static int loadseg(pde_t *, uint64, struct inode *, uint, uint);
-
-// map ELF permissions to PTE permission bits.
-int flags2perm(int flags)
+// map ELF permissions to mmap() protections.
+static int
+flags2prot(int flags)
 {
-    int perm = 0;
-    if(flags & 0x1)
-      perm = PTE_X;
-    if(flags & 0x2)
-      perm |= PTE_W;
-    return perm;
+  int prot = PROT_READ;
+  if(flags & ELF_PROG_FLAG_EXEC)
+    prot |= PROT_EXEC;
+  if(flags & ELF_PROG_FLAG_WRITE)
+    prot |= PROT_WRITE;
+  return prot;
 }
 
 //
-// the implementation of the exec() system call
+// the implementation of the exec() system call.
+// replaces p's user image; p is the caller, or a
+// new process that spawn() has not yet made runnable.
+//
+// the program's segments are not read here: each becomes
+// a MAP_PRIVATE region of the executable, whose pages
+// mmapfault() reads in when the program first touches them.
 //
 int
-kexec(char *path, char **argv)
+kexec(struct proc *p, char *path, char **argv)
 {
   char *s, *last;
-  int i, off;
+  int i, off, nseg = 0;
   uint64 argc, sz = 0, sp, ustack[MAXARG], stackbase;
   struct elfhdr elf;
   struct inode *ip;
-  struct proghdr ph;
+  struct proghdr ph, seg[NVMA];
+  struct file *f = 0;
+  struct vma *v;
   pagetable_t pagetable = 0, oldpagetable;
-  struct proc *p = myproc();
+
+  // other threads would be left without their memory.
+  if(p->mm->ref > 1)
+    return -1;
 
   begin_op();
 
@@ -55,31 +69,40 @@ kexec(char *path, char **argv)
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Note the program's segments, which must come in
+  // address order and not share pages. Zero-fill any
+  // gaps between them now, as sbrk() memory would be.
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
-    if(ph.type != ELF_PROG_LOAD)
+    if(ph.type != ELF_PROG_LOAD || ph.memsz == 0)
       continue;
     if(ph.memsz < ph.filesz)
       goto bad;
-    if(ph.vaddr + ph.memsz < ph.vaddr)
+    if(ph.vaddr + ph.memsz < ph.vaddr || ph.vaddr + ph.memsz > MAXUVA)
       goto bad;
-    if(ph.vaddr % PGSIZE != 0)
+    if(ph.vaddr % PGSIZE != 0 || ph.vaddr < sz)
       goto bad;
-    uint64 sz1;
-    if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz, flags2perm(ph.flags))) == 0)
+    if(nseg == NVMA)
       goto bad;
-    sz = sz1;
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(ph.vaddr > sz && uvmalloc(pagetable, sz, ph.vaddr, 0) == 0)
       goto bad;
+    seg[nseg++] = ph;
+    sz = PGROUNDUP(ph.vaddr + ph.memsz);
   }
-  iunlockput(ip);
+
+  // The segments' regions share an open file, which
+  // takes over our reference to ip.
+  if((f = filealloc()) == 0)
+    goto bad;
+  f->type = FD_INODE;
+  f->ip = ip;
+  f->readable = 1;
+  iunlock(ip);
   end_op();
   ip = 0;
 
-  p = myproc();
-  uint64 oldsz = p->sz;
+  uint64 oldsz = p->mm->sz;
 
   // Allocate some pages at the next page boundary.
   // Make the first inaccessible as a stack guard.
@@ -128,46 +151,38 @@ kexec(char *path, char **argv)
   safestrcpy(p->name, last, sizeof(p->name));
     
   // Commit to the user image.
+  mmapexit(p);
   oldpagetable = p->pagetable;
-  p->pagetable = pagetable;
-  p->sz = sz;
+  p->pagetable = p->mm->pagetable = pagetable;
+  p->mm->asid = 0;  // the old ASID's TLB entries are stale
+  p->mm->tlbcpus = 0;
+  p->mm->sz = sz;
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
-  proc_freepagetable(oldpagetable, oldsz);
+  proc_freepagetable(oldpagetable, oldsz, p->tfslot);
+
+  for(i = 0; i < nseg; i++){
+    v = &p->mm->vma[i];
+    v->start = seg[i].vaddr;
+    v->end = PGROUNDUP(seg[i].vaddr + seg[i].memsz);
+    v->prot = flags2prot(seg[i].flags);
+    v->flags = MAP_PRIVATE;
+    v->f = filedup(f);
+    v->off = seg[i].off;
+    v->filesz = seg[i].filesz;
+  }
+  fileclose(f);
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
  bad:
   if(pagetable)
-    proc_freepagetable(pagetable, sz);
+    proc_freepagetable(pagetable, sz, p->tfslot);
   if(ip){
     iunlockput(ip);
     end_op();
   }
+  if(f)
+    fileclose(f);
   return -1;
 }
-
-// Load an ELF program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
-// Returns 0 on success, -1 on failure.
-static int
-loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz)
-{
-  uint i, n;
-  uint64 pa;
-
-  for(i = 0; i < sz; i += PGSIZE){
-    pa = walkaddr(pagetable, va + i);
-    if(pa == 0)
-      panic("loadseg: address should exist");
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, 0, (uint64)pa, offset+i, n) != n)
-      return -1;
-  }
-  
-  return 0;
-}
@@ -14,15 +14,20 @@
 #include "proc.h"
 
 struct devsw devsw[NDEV];
+
+// file structures come from filecache;
+// ftable.lock protects their reference counts.
 struct {
   struct spinlock lock;
-  struct file file[NFILE];
 } ftable;
 
+static struct kmem_cache *filecache;
+
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  filecache = kmem_cache_create("file", sizeof(struct file));
 }
 
 // Allocate a file structure.
@@ -31,16 +36,11 @@ filealloc(void)
 {
   struct file *f;
 
-  acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
-  }
-  release(&ftable.lock);
-  return 0;
+  if((f = kmem_cache_alloc(filecache)) == 0)
+    return 0;
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -72,6 +72,7 @@ fileclose(struct file *f)
   f->ref = 0;
   f->type = FD_NONE;
   release(&ftable.lock);
+  kmem_cache_free(filecache, f);
 
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
@@ -82,6 +83,38 @@ fileclose(struct file *f)
   }
 }
 
+// Return the open file of the current process's descriptor fd,
+// or 0 if fd isn't open. If other threads share the descriptors,
+// one may close fd meanwhile, so the file comes with a reference
+// of its own and *put is set; the caller passes *put to fdput()
+// when done with the file.
+struct file*
+fdget(int fd, int *put)
+{
+  struct files *fs = myproc()->files;
+  struct file *f;
+
+  *put = 0;
+  if(fd < 0 || fd >= NOFILE)
+    return 0;
+  if(fs->ref == 1)
+    return fs->ofile[fd];
+  acquire(&fs->lock);
+  if((f = fs->ofile[fd]) != 0){
+    filedup(f);
+    *put = 1;
+  }
+  release(&fs->lock);
+  return f;
+}
+
+void
+fdput(struct file *f, int put)
+{
+  if(put)
+    fileclose(f);
+}
+
 // Get metadata about file f.
 // addr is a user virtual address, pointing to a struct stat.
 int
@@ -118,10 +151,20 @@ fileread(struct file *f, uint64 addr, int n)
       return -1;
     r = devsw[f->major].read(1, addr, n);
   } else if(f->type == FD_INODE){
+    // readi() copies out with the inode locked, so the
+    // buffer must be faulted in first (see uvmpin()); but
+    // no further than the file goes.
+    if(n > 0 && f->off + n > f->ip->size)
+      n = f->ip->size > f->off ? f->ip->size - f->off : 0;
+    if(n > 0 && (n = uvmpin(myproc()->pagetable, addr, n, 1)) == 0){
+      uvmunpin();
+      return -1;
+    }
     ilock(f->ip);
     if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
       f->off += r;
     iunlock(f->ip);
+    uvmunpin();
   } else {
     panic("fileread");
   }
@@ -151,7 +194,12 @@ filewrite(struct file *f, uint64 addr, int n)
     // i-node, indirect block, allocation blocks,
     // and 2 blocks of slop for non-aligned writes.
     int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
-    int i = 0;
+    int i = 0, m;
+    // like fileread().
+    if((m = uvmpin(myproc()->pagetable, addr, n, 0)) < n){
+      uvmunpin();
+      return -1;
+    }
     while(i < n){
       int n1 = n - i;
       if(n1 > max)
@@ -170,6 +218,7 @@ filewrite(struct file *f, uint64 addr, int n)
       }
       i += r;
     }
+    uvmunpin();
     ret = (i == n ? n : -1);
   } else {
     panic("filewrite");
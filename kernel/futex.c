@@ -0,0 +1,154 @@
+//
+// Futexes: sleeping until a word of user memory changes.
+//
+// A futex in a MAP_SHARED region is named by the physical
+// address of its word, so that processes sharing the page find
+// the same one whatever address they map it at; the page stays
+// put while it is mapped. Any other futex is private to its
+// address space, and is named by the address space and the
+// virtual address: its page may be copied by a copy-on-write
+// fault, or replaced, while a thread waits on it.
+//
+// Waiters queue on one of a table of buckets hashed by name,
+// and check the word holding the bucket's lock, so that a
+// futexwake() after the word changes can't be missed.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "fcntl.h"
+#include "defs.h"
+
+#define NFUTEXHASH 64
+
+struct key {
+  struct mm *mm;  // address space, or 0 if shared
+  uint64 addr;    // virtual address in mm, or physical
+};
+
+// A thread asleep in futexwait().
+struct waiter {
+  struct key key;
+  int woken;      // set by futexwake()
+  struct waiter *next;
+};
+
+static struct bucket {
+  struct spinlock lock;
+  struct waiter *waiters;  // oldest first
+} buckets[NFUTEXHASH];
+
+static struct bucket*
+bucket(struct key *k)
+{
+  return &buckets[((k->addr ^ (uint64)k->mm) * 0x9E3779B97F4A7C15UL) >> 58];
+}
+
+void
+futexinit(void)
+{
+  int i;
+
+  for(i = 0; i < NFUTEXHASH; i++)
+    initlock(&buckets[i].lock, "futex");
+}
+
+// Name the futex at user address addr in *k, and return the
+// physical address of its word, or 0 if addr isn't a writable
+// word. The lookup, and any copy-on-write fault, happen under
+// mm->lock; the word is later read through the physical
+// address without it, which at worst sees a page just
+// unmapped by another thread.
+static uint64
+futexkey(uint64 addr, struct key *k)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  uint64 pa;
+
+  if(addr % sizeof(uint) != 0)
+    return 0;
+  acquiresleep(&p->mm->lock);
+  pa = uvmwriteaddr(p->pagetable, addr);
+  if((v = vmalookup(p, addr)) != 0 && (v->flags & MAP_SHARED)){
+    k->mm = 0;
+    k->addr = pa;
+  } else {
+    k->mm = p->mm;
+    k->addr = addr;
+  }
+  releasesleep(&p->mm->lock);
+  return pa;
+}
+
+// Sleep until woken by futexwake() on user address addr,
+// if the word there still holds val.
+// Returns 0 once woken, or -1 if the word didn't hold val,
+// addr isn't a writable word, or the process was killed.
+int
+futexwait(uint64 addr, uint val)
+{
+  struct proc *p = myproc();
+  struct waiter w, **wp;
+  struct bucket *b;
+  uint64 pa;
+  int r = 0;
+
+  if((pa = futexkey(addr, &w.key)) == 0)
+    return -1;
+  b = bucket(&w.key);
+  acquire(&b->lock);
+  if(__atomic_load_n((uint*)pa, __ATOMIC_SEQ_CST) != val || killed(p)){
+    r = -1;
+  } else {
+    w.woken = 0;
+    w.next = 0;
+    for(wp = &b->waiters; *wp; wp = &(*wp)->next)
+      ;
+    *wp = &w;
+    while(!w.woken && !killed(p))
+      sleep(&w, &b->lock);
+    if(!w.woken){
+      for(wp = &b->waiters; *wp != &w; wp = &(*wp)->next)
+        ;
+      *wp = w.next;
+      r = -1;
+    }
+  }
+  release(&b->lock);
+  return r;
+}
+
+// Wake up to n threads waiting on the futex at user
+// address addr, longest waiting first.
+// Returns how many woke, or -1.
+int
+futexwake(uint64 addr, int n)
+{
+  struct waiter *w, **wp;
+  struct bucket *b;
+  struct key k;
+  int r = 0;
+
+  if(futexkey(addr, &k) == 0)
+    return -1;
+  b = bucket(&k);
+  acquire(&b->lock);
+  for(wp = &b->waiters; (w = *wp) != 0 && r < n; ){
+    if(w->key.mm == k.mm && w->key.addr == k.addr){
+      *wp = w->next;
+      w->woken = 1;
+      wakeup(w);
+      r++;
+    } else {
+      wp = &w->next;
+    }
+  }
+  release(&b->lock);
+  return r;
+}
@@ -1,6 +1,33 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates blocks of 2^order
+// physically contiguous 4096-byte pages.
+//
+// Free memory is kept by a binary buddy allocator: a free
+// list per order, with blocks aligned to their own size so
+// that a freed block can be merged with its buddy.
+//
+// Single pages (order 0) are the common case, so each CPU
+// also keeps a cache of free pages protected by its own lock.
+// kalloc() and kfree() normally touch only that cache; it is
+// refilled from, and drained back to, the buddy lists in
+// batches. A CPU that finds both its cache and the buddy
+// lists empty steals a batch of pages from another CPU.
+//
+// Idle CPUs zero free pages into a per-CPU pool, from which
+// kzalloc() hands out already-zeroed pages. The pools are
+// still free memory: kalloc() takes from any CPU's pool, and
+// kalloc_order() returns them all to the buddy lists, before
+// either gives up.
+//
+// Every allocated block has a reference count, kept for its
+// first page, so that pages can be shared (e.g. by copy-on-write
+// fork). kalloc() sets it to one, kref() increments it, and
+// kfree() frees the block only when the count drops to zero.
+// ksplit() gives each page of a block a count of its own.
+//
+// Pages are filled with junk on kalloc() and kfree() only in
+// KALLOC_DEBUG builds (make KALLOC_DEBUG=1).
 
 #include "types.h"
 #include "param.h"
@@ -9,6 +36,16 @@
 #include "riscv.h"
 #include "defs.h"
 
+#define KBATCH 32          // pages moved between a CPU cache and the buddy lists
+#define KHIGH  (2*KBATCH)  // drain a CPU cache that grows past this
+#define KSTEAL 32          // max pages moved by one steal
+#define KZPOOL 64          // zeroed pages kept per CPU
+#define KZBATCH 8          // pages zeroed per kzero_idle() call
+
+#define NPAGE  ((PHYSTOP - KERNBASE) / PGSIZE)
+#define PA2IDX(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+#define IDX2PA(i)  ((void*)(KERNBASE + (uint64)(i) * PGSIZE))
+
 void freerange(void *pa_start, void *pa_end);
 
 extern char end[]; // first address after kernel.
@@ -16,50 +53,354 @@ extern char end[]; // first address after kernel.
 
 struct run {
   struct run *next;
+  struct run *prev;  // buddy lists only
 };
 
-struct {
+struct kmem {
   struct spinlock lock;
   struct run *freelist;
-} kmem;
+  int nfree;         // pages on freelist
+  uint64 nsteal;     // batches stolen from other CPUs
+  struct run *zerolist; // zeroed pages for kzalloc()
+  int nzero;         // pages on zerolist
+} kmem[NCPU];
+
+struct {
+  struct spinlock lock;
+  struct run *free[MAXORDER+1];
+  int nfree[MAXORDER+1];
+  // for the first page of each free block, the
+  // block's order plus one; zero for all other pages.
+  uchar state[NPAGE];
+} buddy;
+
+static int pgref[NPAGE];  // reference counts; see above
 
 void
 kinit()
 {
-  initlock(&kmem.lock, "kmem");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kmem[i].lock, "kmem");
+  initlock(&buddy.lock, "buddy");
   freerange(end, (void*)PHYSTOP);
 }
 
+static void
+buddy_insert(struct run *r, int order)
+{
+  r->prev = 0;
+  r->next = buddy.free[order];
+  if(r->next)
+    r->next->prev = r;
+  buddy.free[order] = r;
+  buddy.nfree[order]++;
+  buddy.state[PA2IDX(r)] = order + 1;
+}
+
+static void
+buddy_remove(struct run *r, int order)
+{
+  if(r->prev)
+    r->prev->next = r->next;
+  else
+    buddy.free[order] = r->next;
+  if(r->next)
+    r->next->prev = r->prev;
+  buddy.nfree[order]--;
+  buddy.state[PA2IDX(r)] = 0;
+}
+
+// Take a block of the given order off the buddy lists,
+// splitting a larger block if necessary.
+// Caller must hold buddy.lock.
+static struct run*
+buddy_alloc(int order)
+{
+  struct run *r;
+  int k;
+
+  for(k = order; k <= MAXORDER; k++)
+    if(buddy.free[k])
+      break;
+  if(k > MAXORDER)
+    return 0;
+
+  r = buddy.free[k];
+  buddy_remove(r, k);
+  // return the unused upper halves to the free lists.
+  while(k > order){
+    k--;
+    buddy_insert((struct run*)((char*)r + ((uint64)PGSIZE << k)), k);
+  }
+  return r;
+}
+
+// Put a block of the given order on the buddy lists,
+// merging it with its buddy as long as the buddy is free.
+// Caller must hold buddy.lock.
+static void
+buddy_free(void *pa, int order)
+{
+  uint64 idx, bidx;
+
+  idx = PA2IDX(pa);
+  if(buddy.state[idx] != 0)
+    panic("buddy_free: double free");
+  while(order < MAXORDER){
+    bidx = idx ^ (1L << order);
+    if(bidx >= NPAGE || buddy.state[bidx] != order + 1)
+      break;
+    buddy_remove((struct run*)IDX2PA(bidx), order);
+    idx &= ~(1L << order);
+    order++;
+  }
+  buddy_insert((struct run*)IDX2PA(idx), order);
+}
+
+// Give [pa_start, pa_end) to the buddy lists as the largest
+// naturally aligned blocks that fit. Only the first page of
+// each block is touched; buddy_alloc() splits blocks into
+// smaller ones as they are needed.
 void
 freerange(void *pa_start, void *pa_end)
 {
-  char *p;
-  p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+  uint64 p, e;
+  int k;
+
+  p = PGROUNDUP((uint64)pa_start);
+  e = PGROUNDDOWN((uint64)pa_end);
+  acquire(&buddy.lock);
+  while(p < e){
+    for(k = MAXORDER; k > 0; k--)
+      if(PA2IDX(p) % (1L << k) == 0 && p + ((uint64)PGSIZE << k) <= e)
+        break;
+#ifdef KALLOC_DEBUG
+    memset((void*)p, 1, (uint64)PGSIZE << k);
+#endif
+    buddy_free((void*)p, k);
+    p += (uint64)PGSIZE << k;
+  }
+  release(&buddy.lock);
+}
+
+// Return a batch of pages from CPU cache km to the buddy lists.
+// Interrupts must be disabled.
+static void
+kdrain(struct kmem *km)
+{
+  struct run *r, *next;
+  int n;
+
+  acquire(&km->lock);
+  r = km->freelist;
+  for(n = 0; n < KBATCH && km->freelist; n++)
+    km->freelist = km->freelist->next;
+  km->nfree -= n;
+  release(&km->lock);
+
+  // never hold a kmem lock and buddy.lock at once.
+  acquire(&buddy.lock);
+  for(; n > 0; n--){
+    next = r->next;
+    buddy_free(r, 0);
+    r = next;
+  }
+  release(&buddy.lock);
 }
 
-// Free the page of physical memory pointed at by pa,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// Drop a reference to the page of physical memory pointed
+// at by pa, which normally should have been returned by a
+// call to kalloc(), and free it if that was the last one.
 void
 kfree(void *pa)
 {
   struct run *r;
+  struct kmem *km;
+  int n;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  if((n = __sync_sub_and_fetch(&pgref[PA2IDX(pa)], 1)) > 0)
+    return;
+  if(n < 0)
+    panic("kfree: ref");
+
+#ifdef KALLOC_DEBUG
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
+#endif
 
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  km = &kmem[cpuid()];
+  acquire(&km->lock);
+  r->next = km->freelist;
+  km->freelist = r;
+  n = ++km->nfree;
+  release(&km->lock);
+  if(n > KHIGH)
+    kdrain(km);
+  pop_off();
+}
+
+// Take up to KSTEAL pages (at most half) from some other
+// CPU's cache. Return one of them and put the rest in
+// CPU id's cache. Returns 0 if every cache is empty.
+// Interrupts must be disabled.
+static struct run*
+ksteal(int id)
+{
+  struct run *r, *last;
+  struct kmem *v;
+  int i, n;
+
+  for(i = 1; i < NCPU; i++){
+    v = &kmem[(id + i) % NCPU];
+    acquire(&v->lock);
+    if(v->nfree == 0){
+      release(&v->lock);
+      continue;
+    }
+    n = (v->nfree + 1) / 2;
+    if(n > KSTEAL)
+      n = KSTEAL;
+    r = last = v->freelist;
+    for(int j = 1; j < n; j++)
+      last = last->next;
+    v->freelist = last->next;
+    v->nfree -= n;
+    release(&v->lock);
+
+    // never hold two kmem locks at once.
+    acquire(&kmem[id].lock);
+    if(n > 1){
+      last->next = kmem[id].freelist;
+      kmem[id].freelist = r->next;
+      kmem[id].nfree += n - 1;
+    }
+    kmem[id].nsteal++;
+    release(&kmem[id].lock);
+    return r;
+  }
+  return 0;
+}
+
+// Refill CPU id's cache with up to KBATCH pages from the
+// buddy lists, falling back to stealing from another CPU.
+// Returns one page for the caller, or 0 if out of memory.
+// Interrupts must be disabled.
+static struct run*
+krefill(int id)
+{
+  struct run *r, *head, *tail;
+  int n;
+
+  head = tail = 0;
+  acquire(&buddy.lock);
+  for(n = 0; n < KBATCH; n++){
+    if((r = buddy_alloc(0)) == 0)
+      break;
+    r->next = head;
+    head = r;
+    if(tail == 0)
+      tail = r;
+  }
+  release(&buddy.lock);
+
+  if(head == 0)
+    return ksteal(id);
+
+  if(n > 1){
+    acquire(&kmem[id].lock);
+    tail->next = kmem[id].freelist;
+    kmem[id].freelist = head->next;
+    kmem[id].nfree += n - 1;
+    release(&kmem[id].lock);
+  }
+  return head;
+}
+
+// Take a page from km's pool of zeroed pages, or return 0.
+// Interrupts must be disabled.
+static struct run*
+zpop(struct kmem *km)
+{
+  struct run *r;
+
+  acquire(&km->lock);
+  r = km->zerolist;
+  if(r){
+    km->zerolist = r->next;
+    km->nzero--;
+  }
+  release(&km->lock);
+  return r;
+}
+
+// Take a zeroed page from any CPU's pool, CPU id's first,
+// for want of any other free page. Returns 0 if none.
+// Interrupts must be disabled.
+static struct run*
+zsteal(int id)
+{
+  struct run *r;
+
+  for(int i = 0; i < NCPU; i++)
+    if((r = zpop(&kmem[(id + i) % NCPU])) != 0)
+      return r;
+  return 0;
+}
+
+// Return every CPU's pool of zeroed pages to the buddy lists,
+// so that they can merge into larger blocks.
+// Returns the number of pages returned.
+static int
+zdrain(void)
+{
+  struct run *r, *next;
+  int i, n = 0;
+
+  for(i = 0; i < NCPU; i++){
+    acquire(&kmem[i].lock);
+    r = kmem[i].zerolist;
+    kmem[i].zerolist = 0;
+    kmem[i].nzero = 0;
+    release(&kmem[i].lock);
+
+    // never hold a kmem lock and buddy.lock at once.
+    acquire(&buddy.lock);
+    for(; r; r = next){
+      next = r->next;
+      buddy_free(r, 0);
+      n++;
+    }
+    release(&buddy.lock);
+  }
+  return n;
+}
+
+// Take a page that isn't in a zeroed pool: from CPU id's
+// cache, the buddy lists, or another CPU's cache.
+// Returns 0 if there is none.
+// Interrupts must be disabled.
+static struct run*
+kget(int id)
+{
+  struct kmem *km = &kmem[id];
+  struct run *r;
+
+  acquire(&km->lock);
+  r = km->freelist;
+  if(r){
+    km->freelist = r->next;
+    km->nfree--;
+  }
+  release(&km->lock);
+  if(r == 0)
+    r = krefill(id);
+  return r;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -69,14 +410,182 @@ void *
 kalloc(void)
 {
   struct run *r;
+  int id;
+
+  push_off();
+  id = cpuid();
+  if((r = kget(id)) == 0)
+    r = zsteal(id);
+  pop_off();
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
   if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+    pgref[PA2IDX(r)] = 1;
 
+#ifdef KALLOC_DEBUG
   if(r)
     memset((char*)r, 5, PGSIZE); // fill with junk
+#endif
+  return (void*)r;
+}
+
+// Allocate one 4096-byte page of zeroed physical memory,
+// preferably from this CPU's pool of pages zeroed while idle.
+// Returns 0 if the memory cannot be allocated.
+void *
+kzalloc(void)
+{
+  struct run *r;
+
+  push_off();
+  r = zpop(&kmem[cpuid()]);
+  pop_off();
+
+  if(r){
+    r->next = 0;  // the only non-zero word
+    pgref[PA2IDX(r)] = 1;
+  } else if((r = kalloc()) != 0)
+    memset((char*)r, 0, PGSIZE);
+  return (void*)r;
+}
+
+// Called from an idle CPU's scheduler loop: zero a few
+// free pages into this CPU's pool for kzalloc().
+// Returns the number of pages zeroed.
+// Interrupts must be disabled.
+int
+kzero_idle(void)
+{
+  struct kmem *km = &kmem[cpuid()];
+  struct run *r;
+  int n;
+
+  for(n = 0; n < KZBATCH && km->nzero < KZPOOL; n++){
+    if((r = kget(cpuid())) == 0)
+      break;
+    memset((char*)r, 0, PGSIZE);
+    acquire(&km->lock);
+    r->next = km->zerolist;
+    km->zerolist = r;
+    km->nzero++;
+    release(&km->lock);
+  }
+  return n;
+}
+
+// Allocate 2^order physically contiguous pages, aligned
+// to their total size. Order 0 is the same as kalloc().
+// Returns 0 if no large enough block is free.
+void *
+kalloc_order(int order)
+{
+  struct run *r;
+
+  if(order < 0 || order > MAXORDER)
+    panic("kalloc_order");
+  if(order == 0)
+    return kalloc();
+
+  acquire(&buddy.lock);
+  r = buddy_alloc(order);
+  release(&buddy.lock);
+  if(r == 0 && zdrain() > 0){
+    acquire(&buddy.lock);
+    r = buddy_alloc(order);
+    release(&buddy.lock);
+  }
+
+  if(r)
+    pgref[PA2IDX(r)] = 1;
+
+#ifdef KALLOC_DEBUG
+  if(r)
+    memset((char*)r, 5, (uint64)PGSIZE << order); // fill with junk
+#endif
   return (void*)r;
 }
+
+// Drop a reference to a block returned by kalloc_order(order),
+// and free it if that was the last one.
+void
+kfree_order(void *pa, int order)
+{
+  int n;
+
+  if(order < 0 || order > MAXORDER)
+    panic("kfree_order");
+  if(order == 0){
+    kfree(pa);
+    return;
+  }
+
+  if(((uint64)pa - KERNBASE) % ((uint64)PGSIZE << order) != 0 ||
+     (char*)pa < end || (uint64)pa + ((uint64)PGSIZE << order) > PHYSTOP)
+    panic("kfree_order");
+
+  if((n = __sync_sub_and_fetch(&pgref[PA2IDX(pa)], 1)) > 0)
+    return;
+  if(n < 0)
+    panic("kfree_order: ref");
+
+#ifdef KALLOC_DEBUG
+  // Fill with junk to catch dangling refs.
+  memset(pa, 1, (uint64)PGSIZE << order);
+#endif
+
+  acquire(&buddy.lock);
+  buddy_free(pa, order);
+  release(&buddy.lock);
+}
+
+// Turn an allocated block of 2^order pages into 2^order
+// pages that are referenced and freed separately, each
+// starting with the block's reference count.
+void
+ksplit(void *pa, int order)
+{
+  uint64 i, idx;
+
+  if(((uint64)pa - KERNBASE) % ((uint64)PGSIZE << order) != 0 ||
+     (char*)pa < end || (uint64)pa + ((uint64)PGSIZE << order) > PHYSTOP)
+    panic("ksplit");
+  idx = PA2IDX(pa);
+  for(i = 1; i < (1L << order); i++)
+    pgref[idx + i] = pgref[idx];
+}
+
+// Add a reference to the allocated block starting at pa.
+void
+kref(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kref");
+  if(__sync_fetch_and_add(&pgref[PA2IDX(pa)], 1) < 1)
+    panic("kref: free");
+}
+
+// Return the number of references to the block starting at pa.
+int
+krefcount(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("krefcount");
+  return pgref[PA2IDX(pa)];
+}
+
+// Print allocator statistics to the console.
+// For debugging; runs from procdump() without locks.
+void
+kmemdump(void)
+{
+  for(int i = 0; i < NCPU; i++){
+    struct kmem *km = &kmem[i];
+    if(km->nfree == 0 && km->nzero == 0 && km->nsteal == 0 && km->lock.nts == 0)
+      continue;
+    printf("kmem %d: free %d zeroed %d steal %ld contended %u\n",
+           i, km->nfree, km->nzero, km->nsteal, km->lock.nts);
+  }
+  printf("buddy:");
+  for(int k = 0; k <= MAXORDER; k++)
+    printf(" %d", buddy.nfree[k]);
+  printf(" contended %u\n", buddy.lock.nts);
+}
@@ -11,15 +11,21 @@ void
 main()
 {
   if(cpuid() == 0){
+    uint64 t0 = r_time(), t1;
     consoleinit();
     printfinit();
     printf("\n");
     printf("xv6 kernel is booting\n");
     printf("\n");
+    t1 = r_time();
     kinit();         // physical page allocator
+    t1 = r_time() - t1;
+    slabinit();      // kernel object caches
     kvminit();       // create kernel page table
     kvminithart();   // turn on paging
     procinit();      // process table
+    timersinit();    // sleep deadlines
+    futexinit();     // futex wait table
     trapinit();      // trap vectors
     trapinithart();  // install kernel trap vector
     plicinit();      // set up interrupt controller
@@ -27,8 +33,13 @@ main()
     binit();         // buffer cache
     iinit();         // inode table
     fileinit();      // file table
+    pipeinit();      // pipe cache
+    mmapinit();      // shared memory cache
+    textinit();      // program text cache
     virtio_disk_init(); // emulated hard disk
     userinit();      // first user process
+    printf("boot: kinit %ld us, main %ld us\n",
+           t1 / (TIMEBASE / 1000000), (r_time() - t0) / (TIMEBASE / 1000000));
     __sync_synchronize();
     started = 1;
   } else {
@@ -17,6 +17,11 @@
 // end -- start of kernel page allocation area
 // PHYSTOP -- end RAM used by the kernel
 
+// core local interruptor (CLINT); a write of 1 to a hart's
+// MSIP word raises a machine software interrupt on it.
+#define CLINT 0x2000000L
+#define CLINT_MSIP(hart) (CLINT + 4*(hart))
+
 // qemu puts UART registers here in physical memory.
 #define UART0 0x10000000L
 #define UART0_IRQ 10
@@ -54,6 +59,9 @@
 //   fixed-size stack
 //   expandable heap
 //   ...
+//   trapframes of further threads sharing the page table
 //   TRAPFRAME (p->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
+#define THREADFRAME(i) (TRAPFRAME - (i)*PGSIZE)
+#define MAXUVA THREADFRAME(NTHREAD-1)  // user memory ends below
@@ -0,0 +1,585 @@
+//
+// mmap() and munmap(): files and anonymous memory
+// mapped into user memory.
+//
+// Each address space (struct mm) has a small array of regions
+// (struct vma), placed top-down below the trapframes, well
+// above mm->sz. mm->lock serializes faults and changes, and,
+// once threads share the address space, copies to and from
+// user memory (see copyout()).
+// Pages are read from the file on first touch by
+// mmapfault(); read-only executable pages come from the
+// text cache (text.c) and are shared by every process
+// that maps them. The pages of MAP_SHARED file regions are
+// kept in a cache of their own (struct fpage below), so that
+// every region mapping a page of a file maps the same
+// physical page. Dirty pages of MAP_SHARED regions are
+// written back by munmap(), exit() and exec(); pages of
+// MAP_PRIVATE regions never are, and start out as copies of
+// the shared page if there is one.
+//
+// MAP_ANONYMOUS regions start out zero. The pages of a
+// MAP_SHARED|MAP_ANONYMOUS region are kept in a struct shm,
+// so that processes sharing the region see the same page
+// whichever of them touches it first.
+//
+// fork() shares the child's MAP_SHARED pages with the
+// parent, and makes MAP_PRIVATE pages copy-on-write.
+//
+// exec() also maps each ELF segment as a MAP_PRIVATE region,
+// below mm->sz, so that a program's pages are read from the
+// file only when touched; the part of a segment beyond its
+// filesz (the .bss) comes in as zero pages.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "fs.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "fcntl.h"
+#include "proc.h"
+
+// The pages of a MAP_SHARED|MAP_ANONYMOUS region. The shm
+// holds a reference to each page, as does each page table
+// that maps it.
+struct shm {
+  struct spinlock lock;
+  int ref;                 // regions using this shm
+  int order;               // pages is a kalloc_order(order) block
+  uint64 npages;
+  uint64 *pages;           // physical addresses; 0 if untouched
+};
+
+static struct kmem_cache *shmcache;
+
+// A page of a file mapped by MAP_SHARED regions. The cache
+// holds one reference to the page, and each page table that
+// maps it another; fpagedrop() frees the entry when only the
+// cache's is left. Changes made with write() while a page is
+// cached aren't seen through it.
+struct fpage {
+  uint dev;
+  uint inum;
+  uint64 off;              // page-aligned offset in the file
+  uint64 pa;
+  struct fpage *next;      // hash chain
+};
+
+#define NFPAGEHASH 64
+#define FPAGEHASH(dev, inum, off) \
+  (((dev) * 31 + (inum) * 17 + (off) / PGSIZE) % NFPAGEHASH)
+
+static struct {
+  struct spinlock lock;
+  struct fpage *hash[NFPAGEHASH];
+} fpages;
+
+static struct kmem_cache *fpagecache;
+
+void
+mmapinit(void)
+{
+  shmcache = kmem_cache_create("shm", sizeof(struct shm));
+  initlock(&fpages.lock, "fpages");
+  fpagecache = kmem_cache_create("fpage", sizeof(struct fpage));
+}
+
+// The cached page of ip at off, or 0.
+// Caller must hold fpages.lock.
+static struct fpage*
+fpagelookup(struct inode *ip, uint64 off)
+{
+  struct fpage *f;
+
+  for(f = fpages.hash[FPAGEHASH(ip->dev, ip->inum, off)]; f; f = f->next)
+    if(f->dev == ip->dev && f->inum == ip->inum && f->off == off)
+      return f;
+  return 0;
+}
+
+// Return the shared page of ip at off, reading it in if it
+// isn't cached, with a reference for the caller.
+// Caller must hold ip->lock. Returns 0 if out of memory.
+static uint64
+fpageget(struct inode *ip, uint64 off)
+{
+  struct fpage *f;
+  uint64 pa;
+  char *mem;
+
+  acquire(&fpages.lock);
+  if((f = fpagelookup(ip, off)) != 0){
+    pa = f->pa;
+    kref((void*)pa);
+    release(&fpages.lock);
+    return pa;
+  }
+  release(&fpages.lock);
+
+  // ip->lock keeps anyone else from adding this page.
+  if((mem = kzalloc()) == 0)
+    return 0;
+  if((off < ip->size && readi(ip, 0, (uint64)mem, off, PGSIZE) < 0) ||
+     (f = kmem_cache_alloc(fpagecache)) == 0){
+    kfree(mem);
+    return 0;
+  }
+  f->dev = ip->dev;
+  f->inum = ip->inum;
+  f->off = off;
+  f->pa = (uint64)mem;
+  kref(mem);  // for the caller
+
+  acquire(&fpages.lock);
+  f->next = fpages.hash[FPAGEHASH(ip->dev, ip->inum, off)];
+  fpages.hash[FPAGEHASH(ip->dev, ip->inum, off)] = f;
+  release(&fpages.lock);
+  return (uint64)mem;
+}
+
+// Copy n bytes of ip at off, which is page-aligned, to mem
+// from the shared page if it is cached. Returns 0, or -1 if
+// the page isn't cached.
+static int
+fpagecopy(struct inode *ip, uint64 off, char *mem, uint64 n)
+{
+  struct fpage *f;
+
+  acquire(&fpages.lock);
+  if((f = fpagelookup(ip, off)) != 0)
+    memmove(mem, (char*)f->pa, n);
+  release(&fpages.lock);
+  return f ? 0 : -1;
+}
+
+// Drop the cached page of ip at off once no page table maps
+// it. Called as MAP_SHARED regions are unmapped.
+static void
+fpagedrop(struct inode *ip, uint64 off)
+{
+  struct fpage *f, **fp;
+
+  acquire(&fpages.lock);
+  for(fp = &fpages.hash[FPAGEHASH(ip->dev, ip->inum, off)]; (f = *fp) != 0; fp = &f->next){
+    if(f->dev == ip->dev && f->inum == ip->inum && f->off == off){
+      if(krefcount((void*)f->pa) == 1){
+        *fp = f->next;
+        kfree((void*)f->pa);
+        kmem_cache_free(fpagecache, f);
+      }
+      break;
+    }
+  }
+  release(&fpages.lock);
+}
+
+static struct shm*
+shmalloc(uint64 npages)
+{
+  struct shm *sh;
+  int order;
+
+  for(order = 0; ((uint64)PGSIZE << order) < npages * sizeof(uint64); order++)
+    if(order == MAXORDER)
+      return 0;
+  if((sh = kmem_cache_alloc(shmcache)) == 0)
+    return 0;
+  if((sh->pages = kalloc_order(order)) == 0){
+    kmem_cache_free(shmcache, sh);
+    return 0;
+  }
+  memset(sh->pages, 0, (uint64)PGSIZE << order);
+  initlock(&sh->lock, "shm");
+  sh->ref = 1;
+  sh->order = order;
+  sh->npages = npages;
+  return sh;
+}
+
+static void
+shmput(struct shm *sh)
+{
+  int ref;
+
+  acquire(&sh->lock);
+  ref = --sh->ref;
+  release(&sh->lock);
+  if(ref > 0)
+    return;
+  for(uint64 i = 0; i < sh->npages; i++)
+    if(sh->pages[i])
+      kfree((void*)sh->pages[i]);
+  kfree_order(sh->pages, sh->order);
+  kmem_cache_free(shmcache, sh);
+}
+
+// Take another reference to v's file or shm.
+static void
+vmadup(struct vma *v)
+{
+  if(v->f)
+    filedup(v->f);
+  if(v->shm){
+    acquire(&v->shm->lock);
+    v->shm->ref++;
+    release(&v->shm->lock);
+  }
+}
+
+// Drop v's reference to its file or shm, and free the slot.
+static void
+vmaput(struct vma *v)
+{
+  if(v->f)
+    fileclose(v->f);
+  if(v->shm)
+    shmput(v->shm);
+  memset(v, 0, sizeof(*v));
+}
+
+// The region of p containing va, or 0.
+struct vma*
+vmalookup(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  for(v = p->mm->vma; v < &p->mm->vma[NVMA]; v++)
+    if(v->end && va >= v->start && va < v->end)
+      return v;
+  return 0;
+}
+
+// The lowest address mapped by any of p's mmap() regions, or
+// MAXUVA if none. sbrk() must not grow mm->sz past this.
+uint64
+mmapbase(struct proc *p)
+{
+  struct vma *v;
+  uint64 base = MAXUVA;
+
+  for(v = p->mm->vma; v < &p->mm->vma[NVMA]; v++)
+    if(v->end && v->start >= p->mm->sz && v->start < base)
+      base = v->start;
+  return base;
+}
+
+// Map the page at va of anonymous region v, or of a file
+// region past its file data: the shm's page if v has one,
+// else a new zeroed page.
+static uint64
+anonfault(pagetable_t pagetable, struct vma *v, uint64 va, int perm)
+{
+  struct shm *sh = v->shm;
+  uint64 i, pa;
+
+  if(sh){
+    i = (v->off + (va - v->start)) / PGSIZE;
+    acquire(&sh->lock);
+    if((pa = sh->pages[i]) == 0 && (pa = (uint64)kzalloc()) != 0)
+      sh->pages[i] = pa;
+    if(pa)
+      kref((void*)pa);  // for pagetable
+    release(&sh->lock);
+  } else {
+    pa = (uint64)kzalloc();
+  }
+  if(pa == 0)
+    return 0;
+  if(mappages(pagetable, va, PGSIZE, pa, perm) != 0){
+    kfree((void*)pa);
+    return 0;
+  }
+  return pa;
+}
+
+// Handle a fault at va in one of p's regions: find the shared
+// page of a MAP_SHARED file region, read the page from the
+// mapped file, find or make the page of an anonymous region,
+// or copy a copy-on-write MAP_PRIVATE page.
+// Returns the physical address of the page, or 0 if va is not
+// in a region, the access isn't allowed, or out of memory.
+uint64
+mmapfault(pagetable_t pagetable, uint64 va, int read)
+{
+  struct proc *p = myproc();
+  struct inode *ip;
+  struct vma *v;
+  char *mem;
+  int perm;
+  uint64 off, n;
+
+  if((v = vmalookup(p, va)) == 0)
+    return 0;
+  va = PGROUNDDOWN(va);
+  if(ismapped(pagetable, va)){
+    if(read == 0)
+      return uvmcow(pagetable, va);
+    return 0;
+  }
+  if(read == 0 && (v->prot & PROT_WRITE) == 0)
+    return 0;
+
+  perm = PTE_U | PTE_R;
+  if(v->prot & PROT_WRITE)
+    perm |= PTE_W;
+  if(v->prot & PROT_EXEC)
+    perm |= PTE_X;
+
+  off = va - v->start;
+  if(v->f == 0 || off >= v->filesz)
+    return anonfault(pagetable, v, va, perm);
+  n = v->filesz - off;
+  if(n > PGSIZE)
+    n = PGSIZE;
+
+  // fileread() and filewrite() fault their buffers in before
+  // they lock the inode (see uvmpin()), so the lock order is
+  // mm->lock, then ip->lock.
+  ip = v->f->ip;
+  ilock(ip);
+  if(v->flags & MAP_SHARED){
+    mem = (char*)fpageget(ip, v->off + off);
+  } else if((v->prot & (PROT_WRITE|PROT_EXEC)) == PROT_EXEC){
+    // read-only program text: share the cached page.
+    mem = (char*)textget(ip, v->off + off, n);
+  } else if((mem = kzalloc()) != 0 && fpagecopy(ip, v->off + off, mem, n) < 0 &&
+            v->off + off < ip->size && readi(ip, 0, (uint64)mem, v->off + off, n) < 0){
+    kfree(mem);
+    mem = 0;
+  }
+  iunlock(ip);
+  if(mem == 0)
+    return 0;
+
+  if(mappages(pagetable, va, PGSIZE, (uint64)mem, perm) != 0){
+    kfree(mem);
+    return 0;
+  }
+  return (uint64)mem;
+}
+
+// Write the dirty pages of region v in [start, end) back
+// to the file, without extending it.
+static void
+writeback(struct proc *p, struct vma *v, uint64 start, uint64 end)
+{
+  // at most this many bytes per log transaction; see filewrite().
+  int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+  struct inode *ip = v->f->ip;
+  uint64 a, pa, off;
+  uint n, m;
+  pte_t *pte;
+
+  for(a = start; a < end; a += PGSIZE){
+    if((pte = walk(p->pagetable, a, 0)) == 0)
+      continue;
+    if((*pte & (PTE_V|PTE_D)) != (PTE_V|PTE_D))
+      continue;
+    pa = PTE2PA(*pte);
+    off = v->off + (a - v->start);
+    for(n = 0; n < PGSIZE; n += m){
+      m = PGSIZE - n;
+      if(m > max)
+        m = max;
+      begin_op();
+      ilock(ip);
+      if(off + n >= ip->size){
+        m = PGSIZE - n;
+      } else {
+        if(off + n + m > ip->size)
+          m = ip->size - (off + n);
+        writei(ip, 0, pa + n, off + n, m);
+      }
+      iunlock(ip);
+      end_op();
+    }
+  }
+}
+
+// Remove p's mappings in [start, end), writing back dirty
+// MAP_SHARED pages. A region may lose its beginning, its
+// end, all of it, or a middle part, which splits it in two.
+// Returns -1, having changed nothing, if a split needs a
+// free region slot and there is none.
+int
+vmaunmap(struct proc *p, uint64 start, uint64 end)
+{
+  struct vma *v, *w;
+  uint64 s, e, a;
+  int nsplit = 0, nfree = 0;
+
+  for(v = p->mm->vma; v < &p->mm->vma[NVMA]; v++){
+    if(v->end == 0)
+      nfree++;
+    else if(start > v->start && end < v->end)
+      nsplit++;
+  }
+  if(nsplit > nfree)
+    return -1;
+
+  for(v = p->mm->vma; v < &p->mm->vma[NVMA]; v++){
+    if(v->end == 0 || end <= v->start || start >= v->end)
+      continue;
+    s = start > v->start ? start : v->start;
+    e = end < v->end ? end : v->end;
+    if(v->f && (v->flags & MAP_SHARED))
+      writeback(p, v, s, e);
+    uvmunmap(p->pagetable, s, (e - s) / PGSIZE, 1);
+    if(v->f && (v->flags & MAP_SHARED))
+      for(a = s; a < e; a += PGSIZE)
+        fpagedrop(v->f->ip, v->off + (a - v->start));
+
+    if(s == v->start && e == v->end){
+      vmaput(v);
+    } else if(s == v->start){
+      v->off += e - v->start;
+      v->filesz -= e - v->start < v->filesz ? e - v->start : v->filesz;
+      v->start = e;
+    } else if(e == v->end){
+      v->end = s;
+    } else {
+      for(w = p->mm->vma; w->end; w++)
+        ;
+      *w = *v;
+      w->start = e;
+      w->off = v->off + (e - v->start);
+      w->filesz -= e - v->start < v->filesz ? e - v->start : v->filesz;
+      vmadup(w);
+      v->end = s;
+    }
+  }
+  return 0;
+}
+
+// Give np, a child being created by fork(), p's regions.
+// uvmcopy() has already shared the pages below mm->sz.
+// Called with np->lock held, so must not sleep.
+// Returns 0, or -1 after undoing its work.
+int
+mmapcopy(struct proc *p, struct proc *np)
+{
+  struct vma *v;
+  int i;
+
+  for(i = 0; i < NVMA; i++){
+    v = &p->mm->vma[i];
+    if(v->end == 0 || v->start < p->mm->sz)
+      continue;
+    if(uvmshare(p->pagetable, np->pagetable, v->start, v->end,
+                v->flags & MAP_PRIVATE) < 0){
+      while(--i >= 0){
+        v = &p->mm->vma[i];
+        if(v->end && v->start >= p->mm->sz)
+          uvmunmap(np->pagetable, v->start, (v->end - v->start) / PGSIZE, 1);
+      }
+      return -1;
+    }
+  }
+
+  for(i = 0; i < NVMA; i++){
+    if(p->mm->vma[i].end){
+      np->mm->vma[i] = p->mm->vma[i];
+      vmadup(&np->mm->vma[i]);
+    }
+  }
+  return 0;
+}
+
+// Unmap all of p's regions, for exit() and exec().
+void
+mmapexit(struct proc *p)
+{
+  vmaunmap(p, 0, MAXVA);
+}
+
+// void *mmap(void *addr, uint64 len, int prot, int flags, int fd, uint64 off)
+// addr is ignored; the kernel chooses the address.
+uint64
+sys_mmap(void)
+{
+  uint64 len, off, start;
+  int prot, flags, share, fd, put;
+  struct proc *p = myproc();
+  struct vma *v;
+  struct file *f;
+
+  argaddr(1, &len);
+  argint(2, &prot);
+  argint(3, &flags);
+  argint(4, &fd);
+  argaddr(5, &off);
+
+  if(len == 0 || len > MAXVA || off % PGSIZE != 0)
+    return -1;
+  if((prot & PROT_READ) == 0 || (prot & ~(PROT_READ|PROT_WRITE|PROT_EXEC)) != 0)
+    return -1;
+  share = flags & ~MAP_ANONYMOUS;
+  if(share != MAP_SHARED && share != MAP_PRIVATE)
+    return -1;
+  if(flags & MAP_ANONYMOUS){
+    // fd is ignored.
+    f = 0;
+    off = 0;
+  } else {
+    if((f = fdget(fd, &put)) == 0)
+      return -1;
+    if(f->type != FD_INODE || !f->readable ||
+       (share == MAP_SHARED && (prot & PROT_WRITE) && !f->writable)){
+      fdput(f, put);
+      return -1;
+    }
+    if(!put)
+      filedup(f);  // for the region
+  }
+
+  len = PGROUNDUP(len);
+  acquiresleep(&p->mm->lock);
+  start = mmapbase(p) - len;
+  if(len > mmapbase(p) || start < PGROUNDUP(p->mm->sz))
+    goto bad;
+
+  for(v = p->mm->vma; v < &p->mm->vma[NVMA]; v++){
+    if(v->end == 0){
+      if(flags == (MAP_SHARED|MAP_ANONYMOUS) &&
+         (v->shm = shmalloc(len / PGSIZE)) == 0)
+        goto bad;
+      v->start = start;
+      v->end = start + len;
+      v->prot = prot;
+      v->flags = share;
+      v->f = f;
+      v->off = off;
+      v->filesz = f ? len : 0;
+      releasesleep(&p->mm->lock);
+      return start;
+    }
+  }
+ bad:
+  releasesleep(&p->mm->lock);
+  if(f)
+    fileclose(f);
+  return -1;
+}
+
+// int munmap(void *addr, uint64 len)
+uint64
+sys_munmap(void)
+{
+  uint64 addr, len;
+  struct proc *p = myproc();
+  int r;
+
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  if(addr % PGSIZE != 0 || len == 0 || addr >= MAXVA || len > MAXVA - addr)
+    return -1;
+  acquiresleep(&p->mm->lock);
+  r = vmaunmap(p, addr, addr + PGROUNDUP(len));
+  releasesleep(&p->mm->lock);
+  return r;
+}
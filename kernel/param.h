@@ -1,12 +1,13 @@
 #ifdef LAB_FS
 #define NPROC        10  // maximum number of processes
 #else
-#define NPROC        64  // maximum number of processes (speedsup bigfile)
+#define NPROC       512  // maximum number of processes (speedsup bigfile)
 #endif
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NVMA         16  // mmap() regions per process
+#define NINODE       50  // maximum number of cached unreferenced i-nodes
+#define NTEXTPAGE   256  // pages kept by the program text cache
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
@@ -23,6 +24,16 @@
 #endif
 #endif
 #define MAXPATH      128   // maximum file path name
+#define FAULTAROUND  16    // max pages a lazy page fault maps (1 disables)
+#define MAXORDER     10    // largest kalloc_order() block is 2^MAXORDER pages
+#define TIMEBASE     10000000  // time CSR ticks per second (qemu virt)
+#ifndef TICKHZ
+#define TICKHZ       10    // clock ticks per second (make TICKHZ=n)
+#endif
+#define TICKTIME     (TIMEBASE/TICKHZ)  // time CSR ticks per clock tick
+#define NTHREAD      16    // max threads sharing an address space
+#define NPRIO        4     // scheduling priority levels
+#define BOOSTTICKS   50    // ticks between priority boosts
 
 #ifdef LAB_UTIL
 #define USERSTACK    2     // user stack pages
@@ -3,12 +3,23 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "defs.h"
 
 struct cpu cpus[NCPU];
 
-struct proc proc[NPROC];
+// every proc structure ever allocated, newest first.
+// entries are never removed: an exited process's structure
+// goes back to UNUSED and is reused by allocproc(), so the
+// list can be traversed without a lock.
+struct proc *allproc;
+int nproc;
+struct spinlock proclist_lock;  // protects allproc insertion, nproc
+
+static struct kmem_cache *proccache;
+static struct kmem_cache *mmcache;
+static struct kmem_cache *filescache;
 
 struct proc *initproc;
 
@@ -17,45 +28,344 @@ struct spinlock pid_lock;
 
 extern void forkret(void);
 static void freeproc(struct proc *p);
+static int mmattach(struct proc *p, struct mm *mm);
+static void mmdetach(struct proc *p);
 
 extern char trampoline[]; // trampoline.S
+extern pagetable_t kernel_pagetable; // vm.c
+
+// ASIDs. The kernel's page table uses ASID 0; address spaces
+// are given ASIDs 1..max in turn. When they run out, a new
+// generation starts: each address space gets a fresh ASID the
+// next time one of its threads returns to user space, and each
+// CPU flushes its TLB before it first uses an ASID of the new
+// generation.
+#define ASIDGEN (ASIDMASK+1)
+struct {
+  struct spinlock lock;
+  uint64 gen;     // current generation, a multiple of ASIDGEN
+  uint64 next;    // next ASID to hand out
+  uint64 max;     // largest ASID the CPU supports, or 0
+} asids;
+
+// Sleeping processes wait on one of NSLEEPQ queues, chosen
+// by hashing the channel, so that wakeup() looks only at
+// processes that might be sleeping on its channel.
+// A queue's lock is acquired before any p->lock; p->sleepq
+// and p->qnext change only with both held.
+#define NSLEEPQ 64
+struct sleepq {
+  struct spinlock lock;
+  struct proc *head;    // in order of arrival
+} sleepq[NSLEEPQ];
+
+static struct sleepq*
+chanq(void *chan)
+{
+  return &sleepq[((uint64)chan * 0x9E3779B97F4A7C15UL) >> 58];
+}
 
-// helps ensure that wakeups of wait()ing
-// parents are not lost. helps obey the
-// memory model when using p->parent.
-// must be acquired before any p->lock.
-struct spinlock wait_lock;
+// Each CPU has a queue of RUNNABLE processes. A process joins
+// the queue of the CPU it last ran on when it becomes RUNNABLE
+// (with p->lock held), and a CPU with an empty queue steals
+// from the longest one. A queue's lock is never held while
+// acquiring a p->lock.
+//
+// A process may only run on the CPUs in p->affinity. It is
+// queued on one of them, and other CPUs pass it over when
+// stealing.
+//
+// Scheduling is a multi-level feedback queue. Each queue has
+// NPRIO levels, 0 first; a process runs at level p->prio for
+// up to 1<<prio ticks in all (sleeping doesn't reset the
+// count), then moves down a level. A process running while a
+// higher level has a process waiting gives up the CPU at the
+// next tick. Every BOOSTTICKS ticks all processes go back to
+// the top level they are allowed, p->nice, so that none
+// starves.
+struct runq {
+  struct spinlock lock;
+  struct proc *head[NPRIO];
+  struct proc *tail[NPRIO];
+  int n;
+} runq[NCPU];
+
+int boostgen;  // count of boosts
+uint nextboost;  // ticks at which to boost next
+uint64 cpusonline;  // mask of CPUs that have started scheduling
+
+static int
+affine(struct proc *p, int id)
+{
+  return (p->affinity >> id) & 1;
+}
+
+// The least loaded CPU p may run on.
+static int
+rqpick(struct proc *p)
+{
+  int i, best = p->cpu;
+
+  for(i = 0; i < NCPU; i++)
+    if(affine(p, i) && ((cpusonline >> i) & 1) &&
+       (!affine(p, best) || runq[i].n < runq[best].n))
+      best = i;
+  return best;
+}
+
+// If p has missed a boost, apply it.
+static void
+boosted(struct proc *p)
+{
+  if(p->boostgen != boostgen){
+    p->boostgen = boostgen;
+    p->prio = p->nice;
+    p->slice = 0;
+  }
+}
+
+static void
+rqpush(struct runq *rq, struct proc *p)
+{
+  p->rqnext = 0;
+  if(rq->tail[p->prio])
+    rq->tail[p->prio]->rqnext = p;
+  else
+    rq->head[p->prio] = p;
+  rq->tail[p->prio] = p;
+}
+
+// Make p RUNNABLE and put it on a run queue.
+// Caller must hold p->lock.
+static void
+setrunnable(struct proc *p)
+{
+  struct runq *rq;
+
+  if(!affine(p, p->cpu))
+    p->cpu = rqpick(p);
+  rq = &runq[p->cpu];
+  p->state = RUNNABLE;
+  boosted(p);
+  acquire(&rq->lock);
+  rqpush(rq, p);
+  rq->n++;
+  release(&rq->lock);
+
+  // an idle CPU has no clock tick to notice p.
+  __sync_synchronize();
+  if(p->cpu != cpuid() && cpus[p->cpu].idle)
+    kick(p->cpu);
+}
+
+// Unlink p, which follows prev, from level i of rq.
+static void
+rqunlink(struct runq *rq, int i, struct proc *prev, struct proc *p)
+{
+  if(prev)
+    prev->rqnext = p->rqnext;
+  else
+    rq->head[i] = p->rqnext;
+  if(rq->tail[i] == p)
+    rq->tail[i] = prev;
+  rq->n--;
+}
+
+// Take the first process of the highest level off rq that
+// may run on CPU id, or return 0.
+static struct proc*
+rqpop(struct runq *rq, int id)
+{
+  struct proc *p, *prev;
+  int i;
+
+  acquire(&rq->lock);
+  for(i = 0; i < NPRIO; i++){
+    for(prev = 0, p = rq->head[i]; p; prev = p, p = p->rqnext){
+      if(affine(p, id)){
+        rqunlink(rq, i, prev, p);
+        release(&rq->lock);
+        return p;
+      }
+    }
+  }
+  release(&rq->lock);
+  return 0;
+}
 
-// Allocate a page for each process's kernel stack.
-// Map it high in memory, followed by an invalid
-// guard page.
+// Take p off rq. Returns 0 if p wasn't there, because
+// a scheduler has already taken it.
+static int
+rqremove(struct runq *rq, struct proc *p)
+{
+  struct proc *q, *prev;
+
+  acquire(&rq->lock);
+  for(prev = 0, q = rq->head[p->prio]; q; prev = q, q = q->rqnext){
+    if(q == p){
+      rqunlink(rq, p->prio, prev, p);
+      release(&rq->lock);
+      return 1;
+    }
+  }
+  release(&rq->lock);
+  return 0;
+}
+
+// Move every queued process back to its top level.
+// Processes not on a queue catch up in boosted().
+static void
+boost(void)
+{
+  struct runq *rq;
+  struct proc *p, *list;
+  int i;
+
+  boostgen++;
+  for(rq = runq; rq < &runq[NCPU]; rq++){
+    acquire(&rq->lock);
+    for(i = 0; i < NPRIO; i++){
+      list = rq->head[i];
+      rq->head[i] = rq->tail[i] = 0;
+      while((p = list) != 0){
+        list = p->rqnext;
+        boosted(p);  // to a level no lower than i
+        rqpush(rq, p);
+      }
+    }
+    release(&rq->lock);
+  }
+}
+
+// Charge a clock tick to the process running on this CPU,
+// and decide whether it should give up the CPU (p->resched).
+// Called by clockintr() on every CPU's tick.
 void
-proc_mapstacks(pagetable_t kpgtbl)
+schedtick(void)
 {
-  struct proc *p;
-  
-  for(p = proc; p < &proc[NPROC]; p++) {
-    char *pa = kalloc();
-    if(pa == 0)
-      panic("kalloc");
-    uint64 va = KSTACK((int) (p - proc));
-    kvmmap(kpgtbl, va, (uint64)pa, PGSIZE, PTE_R | PTE_W);
+  struct proc *p = myproc();
+  struct runq *rq = &runq[cpuid()];
+  uint b = nextboost;
+  int i;
+
+  // any CPU may be the one to see ticks pass nextboost.
+  if(ticks >= b && __sync_bool_compare_and_swap(&nextboost, b, ticks + BOOSTTICKS))
+    boost();
+  if(p == 0)
+    return;
+
+  // only this CPU changes p's scheduling state while p runs.
+  boosted(p);
+  if(++p->slice >= (1 << p->prio)){
+    if(p->prio < NPRIO-1)
+      p->prio++;
+    p->slice = 0;
+    p->resched = 1;
+    return;
   }
+  for(i = 0; i < p->prio; i++)
+    if(rq->head[i])  // a hint; no lock
+      p->resched = 1;
+}
+
+// Take a process that may run on this CPU from the longest
+// run queue, or failing that any other, or return 0.
+// The lengths are read without locks, as hints.
+static struct proc*
+steal(void)
+{
+  struct runq *rq, *busiest = 0;
+  struct proc *p;
+  int id = cpuid();
+
+  for(rq = runq; rq < &runq[NCPU]; rq++)
+    if(rq->n > 0 && (busiest == 0 || rq->n > busiest->n))
+      busiest = rq;
+  if(busiest == 0)
+    return 0;
+  if((p = rqpop(busiest, id)) != 0)
+    return p;
+  // busiest holds only processes pinned elsewhere.
+  for(rq = runq; rq < &runq[NCPU]; rq++)
+    if(rq != busiest && rq->n > 0 && (p = rqpop(rq, id)) != 0)
+      return p;
+  return 0;
 }
 
+// helps ensure that wakeups of wait()ing
+// parents are not lost. helps obey the
+// memory model when using p->parent.
+// must be acquired before any p->lock.
+struct spinlock wait_lock;
+
 // initialize the proc table.
 void
 procinit(void)
 {
-  struct proc *p;
-  
   initlock(&pid_lock, "nextpid");
   initlock(&wait_lock, "wait_lock");
-  for(p = proc; p < &proc[NPROC]; p++) {
-      initlock(&p->lock, "proc");
-      p->state = UNUSED;
-      p->kstack = KSTACK((int) (p - proc));
+  initlock(&proclist_lock, "proclist");
+  for(int i = 0; i < NSLEEPQ; i++)
+    initlock(&sleepq[i].lock, "sleepq");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&runq[i].lock, "runq");
+  proccache = kmem_cache_create("proc", sizeof(struct proc));
+  mmcache = kmem_cache_create("mm", sizeof(struct mm));
+  filescache = kmem_cache_create("files", sizeof(struct files));
+
+  // only the ASID bits that the CPU implements hold a 1.
+  uint64 satp = r_satp();
+  w_satp(satp | (ASIDMASK << 44));
+  asids.max = SATP_ASID(r_satp());
+  w_satp(satp);
+  sfence_vma();
+  initlock(&asids.lock, "asid");
+  asids.gen = ASIDGEN;
+  asids.next = 1;
+}
+
+// The satp value with which p should return to user space.
+// Gives p's address space an ASID of the current generation if
+// it lacks one, and flushes this CPU's TLB entries for it if
+// its page table may have changed since this CPU last used it
+// (see uvmflush() in vm.c). Without ASIDs, trampoline.S
+// flushes the whole TLB instead.
+// Called with interrupts off.
+uint64
+procsatp(struct proc *p)
+{
+  struct cpu *c = mycpu();
+  struct mm *mm = p->mm;
+  uint64 me = 1UL << cpuid();
+
+  if(asids.max == 0){
+    __sync_fetch_and_or(&mm->tlbcpus, me);
+    return MAKE_SATP(mm->pagetable, 0);
   }
+
+  if(mm->asid / ASIDGEN != asids.gen / ASIDGEN || c->asidgen != asids.gen){
+    acquire(&asids.lock);
+    if(mm->asid / ASIDGEN != asids.gen / ASIDGEN){
+      if(asids.next > asids.max){
+        asids.gen += ASIDGEN;
+        asids.next = 1;
+      }
+      mm->asid = asids.gen | asids.next++;
+      mm->tlbcpus = 0;
+    }
+    if(c->asidgen != asids.gen){
+      sfence_vma();
+      c->asidgen = asids.gen;
+      __sync_fetch_and_or(&mm->tlbcpus, me);
+    }
+    release(&asids.lock);
+  }
+
+  if((mm->tlbcpus & me) == 0){
+    __sync_fetch_and_or(&mm->tlbcpus, me);
+    sfence_vma_asid(mm->asid & ASIDMASK);
+  }
+  return MAKE_SATP(mm->pagetable, mm->asid & ASIDMASK);
 }
 
 // Must be called with interrupts disabled,
@@ -102,16 +412,61 @@ allocpid()
   return pid;
 }
 
-// Look in the process table for an UNUSED proc.
+// Allocate a new UNUSED proc structure and its kernel stack,
+// and add it to allproc, unless NPROC structures exist already.
+// The n'th structure's stack is mapped at KSTACK(n), with an
+// unmapped guard page below it; like the structure, it is
+// kept for reuse rather than freed.
+// Returns with p->lock held, or 0 on failure.
+static struct proc*
+newproc(void)
+{
+  struct proc *p;
+  char *kstack;
+
+  acquire(&proclist_lock);
+  if(nproc >= NPROC)
+    goto bad;
+  if((p = kmem_cache_alloc(proccache)) == 0)
+    goto bad;
+  if((kstack = kalloc()) == 0){
+    kmem_cache_free(proccache, p);
+    goto bad;
+  }
+  memset(p, 0, sizeof(*p));
+  initlock(&p->lock, "proc");
+  p->state = UNUSED;
+  p->slot = nproc++;
+  p->kstack = KSTACK(p->slot);
+  // the PTE was invalid, and is never changed again.
+  kvmmap(kernel_pagetable, p->kstack, (uint64)kstack, PGSIZE, PTE_R | PTE_W);
+  sfence_vma();
+  acquire(&p->lock);
+
+  p->allnext = allproc;
+  __sync_synchronize(); // p is initialized before it is visible.
+  allproc = p;
+  release(&proclist_lock);
+  return p;
+
+bad:
+  release(&proclist_lock);
+  return 0;
+}
+
+// Look in the process table for an UNUSED proc,
+// or allocate a new one.
 // If found, initialize state required to run in the kernel,
-// and return with p->lock held.
+// and return with p->lock held. The proc gets a new, empty
+// address space, or shares mm if it isn't 0, in which case
+// the caller must hold mm->lock.
 // If there are no free procs, or a memory allocation fails, return 0.
 static struct proc*
-allocproc(void)
+allocproc(struct mm *mm)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
+  for(p = allproc; p; p = p->allnext) {
     acquire(&p->lock);
     if(p->state == UNUSED) {
       goto found;
@@ -119,11 +474,15 @@ allocproc(void)
       release(&p->lock);
     }
   }
-  return 0;
+  if((p = newproc()) == 0)
+    return 0;
 
 found:
   p->pid = allocpid();
+  p->tgid = p->pid;
   p->state = USED;
+  p->affinity = ~0UL;
+  p->lastcpu = -1;
 
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
@@ -132,9 +491,8 @@ found:
     return 0;
   }
 
-  // An empty user page table.
-  p->pagetable = proc_pagetable(p);
-  if(p->pagetable == 0){
+  // An empty user page table, or room in mm's.
+  if(mmattach(p, mm) < 0){
     freeproc(p);
     release(&p->lock);
     return 0;
@@ -155,22 +513,152 @@ found:
 static void
 freeproc(struct proc *p)
 {
+  if(p->mm)
+    mmdetach(p);
   if(p->trapframe)
     kfree((void*)p->trapframe);
   p->trapframe = 0;
-  if(p->pagetable)
-    proc_freepagetable(p->pagetable, p->sz);
-  p->pagetable = 0;
-  p->sz = 0;
+  p->tfslot = 0;
+  p->thread = 0;
   p->pid = 0;
+  p->tgid = 0;
   p->parent = 0;
   p->name[0] = 0;
+  p->faultnext = 0;
+  p->faultwin = 0;
+  p->nfault = 0;
+  p->nfaultpg = 0;
+  p->prio = 0;
+  p->slice = 0;
+  p->nice = 0;
+  p->resched = 0;
+  p->nmigrate = 0;
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
   p->state = UNUSED;
 }
 
+// Give p the address space mm, mapping p's trapframe in a free
+// slot of its page table, or a new address space if mm is 0.
+// The caller must hold mm->lock.
+// Returns 0, or -1 if mm has no free slot or memory runs out.
+static int
+mmattach(struct proc *p, struct mm *mm)
+{
+  int slot;
+
+  if(mm == 0){
+    if((mm = kmem_cache_alloc(mmcache)) == 0)
+      return -1;
+    memset(mm, 0, sizeof(*mm));
+    initsleeplock(&mm->lock, "mm");
+    p->tfslot = 0;
+    if((mm->pagetable = proc_pagetable(p)) == 0){
+      kmem_cache_free(mmcache, mm);
+      return -1;
+    }
+    mm->tfslots = 1;
+  } else {
+    for(slot = 0; slot < NTHREAD; slot++)
+      if((mm->tfslots & (1UL << slot)) == 0)
+        break;
+    if(slot == NTHREAD)
+      return -1;
+    if(mappages(mm->pagetable, THREADFRAME(slot), PGSIZE,
+                (uint64)p->trapframe, PTE_R | PTE_W) < 0)
+      return -1;
+    mm->tfslots |= 1UL << slot;
+    p->tfslot = slot;
+  }
+  mm->ref++;
+  p->mm = mm;
+  p->pagetable = mm->pagetable;
+  return 0;
+}
+
+// Take p out of its address space, unmapping p's trapframe,
+// and free the address space if no other thread uses it.
+// The caller must hold p->mm->lock if others may.
+static void
+mmdetach(struct proc *p)
+{
+  struct mm *mm = p->mm;
+
+  if(mm->ref > 1){
+    uvmunmap(mm->pagetable, THREADFRAME(p->tfslot), 1, 0);
+    mm->tfslots &= ~(1UL << p->tfslot);
+    mm->ref--;
+  } else {
+    proc_freepagetable(mm->pagetable, mm->sz, p->tfslot);
+    kmem_cache_free(mmcache, mm);
+  }
+  p->mm = 0;
+  p->pagetable = 0;
+}
+
+// Make a table of open files that is a copy of fs, taking
+// references on its files and current directory, or an empty
+// one if fs is 0. Returns 0 if out of memory.
+static struct files*
+filesdup(struct files *fs)
+{
+  struct files *nfs;
+  int fd;
+
+  if((nfs = kmem_cache_alloc(filescache)) == 0)
+    return 0;
+  memset(nfs, 0, sizeof(*nfs));
+  initlock(&nfs->lock, "files");
+  nfs->ref = 1;
+  if(fs){
+    acquire(&fs->lock);
+    for(fd = 0; fd < NOFILE; fd++)
+      if(fs->ofile[fd])
+        nfs->ofile[fd] = filedup(fs->ofile[fd]);
+    nfs->cwd = idup(fs->cwd);
+    release(&fs->lock);
+  }
+  return nfs;
+}
+
+// Drop p's reference to its open files and current directory,
+// closing them if no other thread uses them.
+static void
+filesput(struct proc *p)
+{
+  struct files *fs = p->files;
+  int fd, ref;
+
+  p->files = 0;
+  acquire(&fs->lock);
+  ref = --fs->ref;
+  release(&fs->lock);
+  if(ref > 0)
+    return;
+
+  for(fd = 0; fd < NOFILE; fd++)
+    if(fs->ofile[fd])
+      fileclose(fs->ofile[fd]);
+  begin_op();
+  iput(fs->cwd);
+  end_op();
+  kmem_cache_free(filescache, fs);
+}
+
+// Return a new reference to the current directory.
+struct inode*
+cwdget(void)
+{
+  struct files *fs = myproc()->files;
+  struct inode *ip;
+
+  acquire(&fs->lock);
+  ip = idup(fs->cwd);
+  release(&fs->lock);
+  return ip;
+}
+
 // Create a user page table for a given process, with no user memory,
 // but with trampoline and trapframe pages.
 pagetable_t
@@ -193,9 +681,9 @@ proc_pagetable(struct proc *p)
     return 0;
   }
 
-  // map the trapframe page just below the trampoline page, for
+  // map the trapframe page below the trampoline page, for
   // trampoline.S.
-  if(mappages(pagetable, TRAPFRAME, PGSIZE,
+  if(mappages(pagetable, THREADFRAME(p->tfslot), PGSIZE,
               (uint64)(p->trapframe), PTE_R | PTE_W) < 0){
     uvmunmap(pagetable, TRAMPOLINE, 1, 0);
     uvmfree(pagetable, 0);
@@ -205,13 +693,14 @@ proc_pagetable(struct proc *p)
   return pagetable;
 }
 
-// Free a process's page table, and free the
+// Free a process's page table, in which only the trapframe
+// at THREADFRAME(tfslot) is still mapped, and free the
 // physical memory it refers to.
 void
-proc_freepagetable(pagetable_t pagetable, uint64 sz)
+proc_freepagetable(pagetable_t pagetable, uint64 sz, int tfslot)
 {
   uvmunmap(pagetable, TRAMPOLINE, 1, 0);
-  uvmunmap(pagetable, TRAPFRAME, 1, 0);
+  uvmunmap(pagetable, THREADFRAME(tfslot), 1, 0);
   uvmfree(pagetable, sz);
 }
 
@@ -221,17 +710,20 @@ userinit(void)
 {
   struct proc *p;
 
-  p = allocproc();
+  p = allocproc(0);
   initproc = p;
   
-  p->cwd = namei("/");
+  if((p->files = filesdup(0)) == 0)
+    panic("userinit");
+  p->files->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  setrunnable(p);
 
   release(&p->lock);
 }
 
 // Shrink user memory by n bytes.
+// Caller must hold p->mm->lock.
 // Return 0 on success, -1 on failure.
 int
 growproc(int n)
@@ -239,15 +731,17 @@ growproc(int n)
   uint64 sz;
   struct proc *p = myproc();
 
-  sz = p->sz;
+  sz = p->mm->sz;
   if(n > 0){
     if((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
       return -1;
     }
   } else if(n < 0){
-    sz = uvmdealloc(p->pagetable, sz, sz + n);
+    vmaunmap(p, PGROUNDUP(sz + n), PGROUNDUP(sz));
+    if((sz = uvmdealloc(p->pagetable, sz, sz + n)) == p->mm->sz)
+      return -1;
   }
-  p->sz = sz;
+  p->mm->sz = sz;
   return 0;
 }
 
@@ -256,22 +750,43 @@ growproc(int n)
 int
 kfork(void)
 {
-  int i, pid;
+  int pid;
   struct proc *np;
   struct proc *p = myproc();
 
+  // keep other threads from changing memory while it's copied.
+  acquiresleep(&p->mm->lock);
+
   // Allocate process.
-  if((np = allocproc()) == 0){
+  if((np = allocproc(0)) == 0){
+    releasesleep(&p->mm->lock);
     return -1;
   }
 
   // Copy user memory from parent to child.
-  if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
+  if(uvmcopy(p->pagetable, np->pagetable, p->mm->sz) < 0){
+    freeproc(np);
+    release(&np->lock);
+    releasesleep(&p->mm->lock);
+    return -1;
+  }
+  np->mm->sz = p->mm->sz;
+
+  // share or copy-on-write the mmap()ed regions.
+  if(mmapcopy(p, np) < 0){
+    freeproc(np);
+    release(&np->lock);
+    releasesleep(&p->mm->lock);
+    return -1;
+  }
+  releasesleep(&p->mm->lock);
+
+  // increment reference counts on open file descriptors.
+  if((np->files = filesdup(p->files)) == 0){
     freeproc(np);
     release(&np->lock);
     return -1;
   }
-  np->sz = p->sz;
 
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
@@ -279,11 +794,112 @@ kfork(void)
   // Cause fork to return 0 in the child.
   np->trapframe->a0 = 0;
 
-  // increment reference counts on open file descriptors.
+  safestrcpy(np->name, p->name, sizeof(p->name));
+
+  pid = np->pid;
+
+  release(&np->lock);
+
+  acquire(&wait_lock);
+  np->parent = p;
+  release(&wait_lock);
+
+  acquire(&np->lock);
+  np->cpu = cpuid();
+  np->nice = p->nice;
+  np->prio = p->nice;
+  np->affinity = p->affinity;
+  setrunnable(np);
+  release(&np->lock);
+
+  return pid;
+}
+
+// Create a child running the program path, without copying
+// the caller's memory. The child's open files are ofile,
+// whose references kspawn takes over even if it fails.
+// Returns the child's pid, or -1.
+int
+kspawn(char *path, char **argv, struct file **ofile)
+{
+  int i, argc, pid;
+  struct proc *np;
+  struct proc *p = myproc();
+
+  if((np = allocproc(0)) == 0 || (np->files = filesdup(0)) == 0){
+    if(np){
+      freeproc(np);
+      release(&np->lock);
+    }
+    for(i = 0; i < NOFILE; i++)
+      if(ofile[i])
+        fileclose(ofile[i]);
+    return -1;
+  }
   for(i = 0; i < NOFILE; i++)
-    if(p->ofile[i])
-      np->ofile[i] = filedup(p->ofile[i]);
-  np->cwd = idup(p->cwd);
+    np->files->ofile[i] = ofile[i];
+  np->files->cwd = cwdget();
+  memset(np->trapframe, 0, sizeof(*np->trapframe));
+
+  // np is USED and has no parent, so no one else will
+  // look at it while kexec() sleeps.
+  release(&np->lock);
+
+  if((argc = kexec(np, path, argv)) < 0){
+    filesput(np);
+    acquire(&np->lock);
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+  np->trapframe->a0 = argc;
+  pid = np->pid;
+
+  acquire(&wait_lock);
+  np->parent = p;
+  release(&wait_lock);
+
+  acquire(&np->lock);
+  np->cpu = cpuid();
+  np->nice = p->nice;
+  np->prio = p->nice;
+  np->affinity = p->affinity;
+  setrunnable(np);
+  release(&np->lock);
+
+  return pid;
+}
+
+// Create a thread: a child that shares the caller's address
+// space, open files and current directory, and starts by
+// calling fn(arg) on the user stack whose top is sp.
+// Returns the thread's pid, or -1.
+int
+kclone(uint64 fn, uint64 arg, uint64 sp)
+{
+  int pid, killed, xstate;
+  struct proc *np;
+  struct proc *p = myproc();
+
+  acquiresleep(&p->mm->lock);
+  if((np = allocproc(p->mm)) == 0){
+    releasesleep(&p->mm->lock);
+    return -1;
+  }
+  releasesleep(&p->mm->lock);
+
+  *(np->trapframe) = *(p->trapframe);
+  np->trapframe->epc = fn;
+  np->trapframe->a0 = arg;
+  np->trapframe->sp = sp & ~0xfUL;  // riscv sp must be 16-byte aligned
+  np->trapframe->ra = 0;            // fn must not return
+  np->thread = 1;
+  np->tgid = p->tgid;
+
+  acquire(&p->files->lock);
+  p->files->ref++;
+  release(&p->files->lock);
+  np->files = p->files;
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
@@ -293,54 +909,125 @@ kfork(void)
 
   acquire(&wait_lock);
   np->parent = p;
+  // a kill() of p's threads may have looked at np before
+  // np joined them; if so, it killed p.
+  acquire(&p->lock);
+  killed = p->killed;
+  xstate = p->xstate;
+  release(&p->lock);
   release(&wait_lock);
 
   acquire(&np->lock);
-  np->state = RUNNABLE;
+  if(killed){
+    np->killed = 1;
+    np->xstate = xstate;
+  }
+  np->cpu = cpuid();
+  np->nice = p->nice;
+  np->prio = p->nice;
+  np->affinity = p->affinity;
+  setrunnable(np);
   release(&np->lock);
 
   return pid;
 }
 
-// Pass p's abandoned children to init.
+// Mark each live thread of the process tgid killed, with exit
+// status status, unless it has been already.
+// Caller must hold wait_lock.
+static void
+killthreads(int tgid, int status)
+{
+  struct proc *pp;
+
+  for(pp = allproc; pp; pp = pp->allnext){
+    acquire(&pp->lock);
+    if(pp->tgid == tgid && pp->state != ZOMBIE && !pp->killed){
+      pp->killed = 1;
+      pp->xstate = status;
+      if(pp->state == SLEEPING){
+        // Wake process from sleep(), which
+        // takes it off its sleep queue.
+        setrunnable(pp);
+      }
+    }
+    release(&pp->lock);
+  }
+}
+
+// Pass p's abandoned children to init, which reaps
+// threads with wait() like any other child.
 // Caller must hold wait_lock.
 void
 reparent(struct proc *p)
 {
   struct proc *pp;
 
-  for(pp = proc; pp < &proc[NPROC]; pp++){
+  for(pp = allproc; pp; pp = pp->allnext){
     if(pp->parent == p){
       pp->parent = initproc;
+      pp->thread = 0;
       wakeup(initproc);
     }
   }
 }
 
-// Exit the current process.  Does not return.
-// An exited process remains in the zombie state
-// until its parent calls wait().
+// Leave p's address space, first writing back and unmapping
+// its mmap()ed files if p is its last thread.
+static void
+mmexit(struct proc *p)
+{
+  struct mm *mm = p->mm;
+
+  acquiresleep(&mm->lock);
+  if(mm->ref == 1){
+    // no other thread can get at mm.
+    releasesleep(&mm->lock);
+    mmapexit(p);
+    mmdetach(p);
+  } else {
+    mmdetach(p);
+    releasesleep(&mm->lock);
+  }
+}
+
+// Exit the current process, with all its threads.  Does not
+// return. The other threads are killed, and exit with the
+// same status when they notice; if this one was killed,
+// it exits with the status it was killed with.
 void
 kexit(int status)
 {
   struct proc *p = myproc();
 
+  acquire(&wait_lock);
+  acquire(&p->lock);
+  if(p->killed)
+    status = p->xstate;
+  release(&p->lock);
+  killthreads(p->tgid, status);
+  release(&wait_lock);
+
+  ktexit(status);
+}
+
+// Exit the current thread only.  Does not return.
+// An exited thread remains in the zombie state
+// until its parent calls wait() or join().
+void
+ktexit(int status)
+{
+  struct proc *p = myproc();
+
   if(p == initproc)
     panic("init exiting");
 
-  // Close all open files.
-  for(int fd = 0; fd < NOFILE; fd++){
-    if(p->ofile[fd]){
-      struct file *f = p->ofile[fd];
-      fileclose(f);
-      p->ofile[fd] = 0;
-    }
-  }
+  // Give up the address space, and with it the mmap()ed files
+  // if no other thread is using them.
+  mmexit(p);
 
-  begin_op();
-  iput(p->cwd);
-  end_op();
-  p->cwd = 0;
+  // and the open files.
+  filesput(p);
 
   acquire(&wait_lock);
 
@@ -362,13 +1049,15 @@ kexit(int status)
   panic("zombie exit");
 }
 
-// Wait for a child process to exit and return its pid.
-// Return -1 if this process has no children.
-int
-kwait(uint64 addr)
+// Wait for a child to exit and return its pid: a thread made
+// by clone() if thread is set, else any other child; and if
+// pid isn't 0, only the child pid.
+// Return -1 if this process has no such children.
+static int
+reap(int thread, int pid, uint64 addr)
 {
   struct proc *pp;
-  int havekids, pid;
+  int havekids, xstate;
   struct proc *p = myproc();
 
   acquire(&wait_lock);
@@ -376,24 +1065,24 @@ kwait(uint64 addr)
   for(;;){
     // Scan through table looking for exited children.
     havekids = 0;
-    for(pp = proc; pp < &proc[NPROC]; pp++){
-      if(pp->parent == p){
+    for(pp = allproc; pp; pp = pp->allnext){
+      if(pp->parent == p && pp->thread == thread && (pid == 0 || pp->pid == pid)){
         // make sure the child isn't still in exit() or swtch().
         acquire(&pp->lock);
 
         havekids = 1;
         if(pp->state == ZOMBIE){
           // Found one.
+          // copy the status out only after dropping the
+          // locks, since the copy may sleep.
           pid = pp->pid;
-          if(addr != 0 && copyout(p->pagetable, addr, (char *)&pp->xstate,
-                                  sizeof(pp->xstate)) < 0) {
-            release(&pp->lock);
-            release(&wait_lock);
-            return -1;
-          }
+          xstate = pp->xstate;
           freeproc(pp);
           release(&pp->lock);
           release(&wait_lock);
+          if(addr != 0 && copyout(p->pagetable, addr, (char *)&xstate,
+                                  sizeof(xstate)) < 0)
+            return -1;
           return pid;
         }
         release(&pp->lock);
@@ -411,6 +1100,23 @@ kwait(uint64 addr)
   }
 }
 
+// Wait for a child process to exit and return its pid.
+// Return -1 if this process has no children.
+int
+kwait(uint64 addr)
+{
+  return reap(0, 0, addr);
+}
+
+// Wait for thread tid, or any thread if tid is 0, made by
+// this process with clone() to exit, and return its pid.
+// Return -1 if there is no such thread.
+int
+kjoin(int tid, uint64 addr)
+{
+  return reap(1, tid, addr);
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
@@ -423,8 +1129,10 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  int idle = 0;
 
   c->proc = 0;
+  __sync_fetch_and_or(&cpusonline, 1UL << cpuid());
   for(;;){
     // The most recent process to run may have had interrupts
     // turned off; enable them to avoid a deadlock if all
@@ -434,28 +1142,51 @@ scheduler(void)
     intr_on();
     intr_off();
 
-    int found = 0;
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
-        found = 1;
-      }
-      release(&p->lock);
+    // say we're idle before looking at the run queues, so
+    // that setrunnable() elsewhere either sees it and kicks
+    // us, or queues in time for us to see.
+    c->idle = 1;
+    __sync_synchronize();
+    if((p = rqpop(&runq[cpuid()], cpuid())) == 0 && (p = steal()) == 0){
+      // nothing to run; zero some free pages for kzalloc(),
+      // or stop running on this core until an interrupt,
+      // with no clock tick (see clockintr()).
+      idle = 1;
+      if(kzero_idle() == 0)
+        asm volatile("wfi");
+      continue;
     }
-    if(found == 0) {
-      // nothing to run; stop running on this core until an interrupt.
-      asm volatile("wfi");
+    c->idle = 0;
+    if(idle){
+      tickresume();
+      idle = 0;
+    }
+
+    // p may still be on its way off another CPU, as after
+    // yield(); its lock waits for that.
+    acquire(&p->lock);
+    if(p->state != RUNNABLE)
+      panic("scheduler: not runnable");
+    if(!affine(p, cpuid())){
+      // its affinity changed after it was queued.
+      setrunnable(p);
+      release(&p->lock);
+      continue;
     }
+    // Switch to chosen process.  It is the process's job
+    // to release its lock and then reacquire it
+    // before jumping back to us.
+    p->state = RUNNING;
+    if(p->lastcpu >= 0 && p->lastcpu != cpuid())
+      p->nmigrate++;
+    p->cpu = p->lastcpu = cpuid();
+    c->proc = p;
+    swtch(&c->context, &p->context);
+
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    c->proc = 0;
+    release(&p->lock);
   }
 }
 
@@ -492,7 +1223,8 @@ yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  p->resched = 0;
+  setrunnable(p);
   sched();
   release(&p->lock);
 }
@@ -521,7 +1253,7 @@ forkret(void)
 
     // We can invoke kexec() now that file system is initialized.
     // Put the return value (argc) of kexec into a0.
-    p->trapframe->a0 = kexec("/init", (char *[]){ "/init", 0 });
+    p->trapframe->a0 = kexec(p, "/init", (char *[]){ "/init", 0 });
     if (p->trapframe->a0 == -1) {
       panic("exec");
     }
@@ -529,7 +1261,7 @@ forkret(void)
 
   // return to user space, mimicing usertrap()'s return.
   prepare_return();
-  uint64 satp = MAKE_SATP(p->pagetable);
+  uint64 satp = procsatp(p);
   uint64 trampoline_userret = TRAMPOLINE + (userret - trampoline);
   ((void (*)(uint64))trampoline_userret)(satp);
 }
@@ -540,66 +1272,185 @@ void
 sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc();
+  struct sleepq *q = chanq(chan);
+  struct proc **pp;
   
   // Must acquire p->lock in order to
   // change p->state and then call sched.
-  // Once we hold p->lock, we can be
+  // Once we hold q->lock, we can be
   // guaranteed that we won't miss any wakeup
-  // (wakeup locks p->lock),
+  // (wakeup locks q->lock),
   // so it's okay to release lk.
 
+  acquire(&q->lock);
   acquire(&p->lock);  //DOC: sleeplock1
   release(lk);
 
   // Go to sleep.
   p->chan = chan;
   p->state = SLEEPING;
+  for(pp = &q->head; *pp; pp = &(*pp)->qnext)
+    ;
+  *pp = p;
+  p->sleepq = q;
+  release(&q->lock);
 
   sched();
 
-  // Tidy up.
+  // Tidy up. wakeup() took p off the queue,
+  // unless kill() is what woke it.
   p->chan = 0;
+  if(p->sleepq){
+    release(&p->lock);
+    acquire(&q->lock);
+    acquire(&p->lock);
+    for(pp = &q->head; *pp; pp = &(*pp)->qnext){
+      if(*pp == p){
+        *pp = p->qnext;
+        break;
+      }
+    }
+    p->qnext = 0;
+    p->sleepq = 0;
+    release(&q->lock);
+  }
 
   // Reacquire original lock.
   release(&p->lock);
   acquire(lk);
 }
 
+// Wake up to n processes sleeping on chan, or all of them
+// if n < 0, longest waiting first. Returns how many woke.
+static int
+wake(void *chan, int n)
+{
+  struct sleepq *q = chanq(chan);
+  struct proc *p, **pp;
+  int woke, nwoke = 0;
+
+  acquire(&q->lock);
+  for(pp = &q->head; (p = *pp) != 0; ){
+    acquire(&p->lock);
+    if(p->chan != chan){
+      release(&p->lock);
+      pp = &p->qnext;
+      continue;
+    }
+    // take p off the queue, even if kill() has woken it.
+    *pp = p->qnext;
+    p->qnext = 0;
+    p->sleepq = 0;
+    woke = p->state == SLEEPING;
+    if(woke)
+      setrunnable(p);
+    release(&p->lock);
+    if(woke && ++nwoke == n)
+      break;
+  }
+  release(&q->lock);
+  return nwoke;
+}
+
 // Wake up all processes sleeping on channel chan.
 // Caller should hold the condition lock.
 void
 wakeup(void *chan)
+{
+  wake(chan, -1);
+}
+
+// Wake up one process sleeping on channel chan, for
+// conditions that only one waiter can consume. A waiter
+// that leaves some of the condition unconsumed should
+// pass it on with another wakeup_one().
+// Caller should hold the condition lock.
+void
+wakeup_one(void *chan)
+{
+  wake(chan, 1);
+}
+
+// Kill the process with the given pid, with all its threads.
+// The victim won't exit until it tries to return
+// to user space (see usertrap() in trap.c).
+int
+kkill(int pid)
 {
   struct proc *p;
+  int tgid;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    if(p != myproc()){
-      acquire(&p->lock);
-      if(p->state == SLEEPING && p->chan == chan) {
-        p->state = RUNNABLE;
-      }
+  acquire(&wait_lock);
+  for(p = allproc; p; p = p->allnext){
+    acquire(&p->lock);
+    if(p->pid == pid){
+      tgid = p->tgid;
       release(&p->lock);
+      killthreads(tgid, -1);
+      release(&wait_lock);
+      return 0;
     }
+    release(&p->lock);
   }
+  release(&wait_lock);
+  return -1;
 }
 
-// Kill the process with the given pid.
-// The victim won't exit until it tries to return
-// to user space (see usertrap() in trap.c).
+// Let the process pid (0 for the caller) run only on the
+// CPUs in mask. Returns 0, or -1 if there is no such process
+// or mask holds no running CPU.
 int
-kkill(int pid)
+setaffinity(int pid, uint64 mask)
 {
   struct proc *p;
+  int move;
 
-  for(p = proc; p < &proc[NPROC]; p++){
+  mask &= cpusonline;
+  if(mask == 0)
+    return -1;
+  if(pid == 0)
+    pid = myproc()->pid;
+  for(p = allproc; p; p = p->allnext){
     acquire(&p->lock);
     if(p->pid == pid){
-      p->killed = 1;
-      if(p->state == SLEEPING){
-        // Wake process from sleep().
-        p->state = RUNNABLE;
+      p->affinity = mask;
+      move = 0;
+      if(!affine(p, p->cpu)){
+        if(p->state == RUNNABLE && rqremove(&runq[p->cpu], p))
+          setrunnable(p);  // onto an allowed CPU's queue
+        else if(p->state == RUNNING)
+          p->resched = 1;  // move at the next tick
+        move = (p == myproc());
       }
       release(&p->lock);
+      if(move)
+        yield();
+      return 0;
+    }
+    release(&p->lock);
+  }
+  return -1;
+}
+
+// Copy the affinity of process pid (0 for the caller) to
+// *mask, and the number of times it has moved between CPUs
+// to *nmigrate, if they aren't 0.
+// Returns 0, or -1 if there is no such process.
+int
+getaffinity(int pid, uint64 *mask, int *nmigrate)
+{
+  struct proc *p;
+
+  if(pid == 0)
+    pid = myproc()->pid;
+  for(p = allproc; p; p = p->allnext){
+    acquire(&p->lock);
+    if(p->pid == pid){
+      if(mask)
+        *mask = p->affinity & cpusonline;
+      if(nmigrate)
+        *nmigrate = p->nmigrate;
+      release(&p->lock);
       return 0;
     }
     release(&p->lock);
@@ -611,7 +1462,10 @@ void
 setkilled(struct proc *p)
 {
   acquire(&p->lock);
-  p->killed = 1;
+  if(!p->killed){
+    p->killed = 1;
+    p->xstate = -1;
+  }
   release(&p->lock);
 }
 
@@ -674,7 +1528,7 @@ procdump(void)
   char *state;
 
   printf("\n");
-  for(p = proc; p < &proc[NPROC]; p++){
+  for(p = allproc; p; p = p->allnext){
     if(p->state == UNUSED)
       continue;
     if(p->state >= 0 && p->state < NELEM(states) && states[p->state])
@@ -682,6 +1536,13 @@ procdump(void)
     else
       state = "???";
     printf("%d %s %s", p->pid, state, p->name);
+    printf(" cpu %d prio %d mig %d", p->cpu, p->prio, p->nmigrate);
+    if(p->nfault)
+      printf(" faults %d pages %d", p->nfault, p->nfaultpg);
     printf("\n");
   }
+  kmemdump();
+  slabdump();
+  textdump();
+  kvmdump();
 }
@@ -24,6 +24,11 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  uint64 asidgen;             // ASID generation the TLB is flushed for
+  uint64 nexttick;            // time of the next clock tick
+  int idle;                   // In scheduler() with nothing to run; no clock tick
+  volatile uint64 tlbreq;     // TLB flushes other CPUs have asked for
+  volatile uint64 tlbdone;    // tlbreq when this CPU last flushed for them
 };
 
 extern struct cpu cpus[NCPU];
@@ -81,6 +86,41 @@ struct trapframe {
 
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+// A region of user memory mapped from a file by mmap(),
+// or an ELF segment mapped by exec().
+struct vma {
+  uint64 start;                // First address, page-aligned
+  uint64 end;                  // One past the last; 0 if slot is free
+  int prot;                    // PROT_READ, PROT_WRITE, PROT_EXEC
+  int flags;                   // MAP_SHARED or MAP_PRIVATE
+  struct file *f;              // Mapped file, or 0 if anonymous
+  struct shm *shm;             // Pages of a shared anonymous region
+  uint64 off;                  // File (or shm) offset of start
+  uint64 filesz;               // Bytes of file from off; the rest is zero
+};
+
+// An address space: a user page table and the memory mapped in
+// it. Threads made by clone() share their creator's.
+struct mm {
+  struct sleeplock lock;       // Held while faulting or changing the mappings
+  int ref;                     // Threads using it
+  pagetable_t pagetable;       // User page table
+  uint64 sz;                   // Size of process memory (bytes)
+  struct vma vma[NVMA];        // mmap()ed regions and ELF segments
+  uint64 tfslots;              // Bit i set if THREADFRAME(i) is mapped
+  uint64 asid;                 // ASID, with its generation above ASIDMASK
+  uint64 tlbcpus;              // CPUs that may have TLB entries for asid
+};
+
+// Open files and current directory. Threads made by clone()
+// share their creator's; fork() copies them.
+struct files {
+  struct spinlock lock;        // Held while using ofile[] and cwd
+  int ref;                     // Threads using it
+  struct file *ofile[NOFILE];  // Open files
+  struct inode *cwd;           // Current directory
+};
+
 // Per-process state
 struct proc {
   struct spinlock lock;
@@ -91,17 +131,43 @@ struct proc {
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  int tgid;                    // pid of the process whose threads include p
+  int cpu;                     // CPU whose run queue p joins
+  int lastcpu;                 // CPU p last ran on, or -1
+  uint64 affinity;             // Mask of CPUs p may run on
+  int nmigrate;                // Times p has run on a new CPU
+  struct proc *rqnext;         // Next on run queue
+  int prio;                    // Run queue level, 0 first
+  int slice;                   // Ticks used at this level
+  int nice;                    // Highest level p may run at
+  int boostgen;                // Last priority boost applied
+  int resched;                 // Should yield at the next timer interrupt
+
+  // p->lock and p->sleepq's lock must be held to change these:
+  struct sleepq *sleepq;       // Queue p sleeps on, if any
+  struct proc *qnext;          // Next on sleepq
 
   // wait_lock must be held when using this:
   struct proc *parent;         // Parent process
 
+  // set once when the structure is created.
+  struct proc *allnext;        // Next in allproc list
+  int slot;                    // Index among allproc entries
+  uint64 kstack;               // Virtual address of kernel stack, KSTACK(slot)
+
   // these are private to the process, so p->lock need not be held.
-  uint64 kstack;               // Virtual address of kernel stack
-  uint64 sz;                   // Size of process memory (bytes)
-  pagetable_t pagetable;       // User page table
+  struct mm *mm;               // Address space
+  pagetable_t pagetable;       // User page table, mm->pagetable
   struct trapframe *trapframe; // data page for trampoline.S
+  int tfslot;                  // Trapframe is mapped at THREADFRAME(tfslot)
+  int thread;                  // Made by clone(); reaped by join()
   struct context context;      // swtch() here to run process
-  struct file *ofile[NOFILE];  // Open files
-  struct inode *cwd;           // Current directory
+  struct files *files;         // Open files and current directory
   char name[16];               // Process name (debugging)
+  uint64 faultnext;            // Page after the last fault-around window
+  int faultwin;                // Pages in the last fault-around window
+  int nfault;                  // Lazy page faults taken
+  int nfaultpg;                // Pages mapped by lazy faults
+  uint64 deadline;             // When to wake from sleepuntil()
+  int timeridx;                // 1 + index in timer heap, or 0
 };
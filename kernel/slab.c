@@ -0,0 +1,223 @@
+// Object caches for small, fixed-size kernel structures
+// (processes, open files, pipes, in-memory inodes).
+//
+// A cache carves pages from kalloc() into objects of one size.
+// Each page, a slab, begins with a struct slab and keeps a list
+// of its free objects; slabs with free objects are on the cache's
+// partial list, and a slab whose objects are all free goes back
+// to kalloc() unless it is the cache's only partial slab.
+//
+// Each CPU also keeps a magazine of free objects for each cache,
+// so most allocations and frees touch neither the cache lock nor
+// the slabs. Magazines are refilled and flushed half at a time.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define NCACHE   8   // maximum number of caches
+#define MAGSIZE 16   // objects per CPU magazine
+
+struct slab {
+  struct kmem_cache *cache;
+  struct slab *next;   // cache's partial list
+  struct slab *prev;
+  void *free;          // free objects in this slab
+  int inuse;           // objects not on free (including magazines)
+};
+
+#define SLABHDR ((sizeof(struct slab) + 7) & ~7)
+
+struct magazine {
+  int n;
+  void *obj[MAGSIZE];
+};
+
+struct kmem_cache {
+  char *name;
+  uint size;               // object size, a multiple of 8
+  uint perslab;            // objects per slab
+  struct spinlock lock;
+  struct slab *partial;    // slabs with free objects
+  int nslab;               // slabs allocated
+  struct magazine mag[NCPU];
+};
+
+static struct {
+  struct spinlock lock;
+  int n;
+  struct kmem_cache cache[NCACHE];
+} caches;
+
+void
+slabinit(void)
+{
+  initlock(&caches.lock, "caches");
+}
+
+// Create a cache of objects of the given size.
+// name must be a string constant.
+struct kmem_cache*
+kmem_cache_create(char *name, uint size)
+{
+  struct kmem_cache *c;
+
+  size = (size + 7) & ~7;
+  if(size == 0 || size > PGSIZE - SLABHDR)
+    panic("kmem_cache_create: size");
+
+  acquire(&caches.lock);
+  if(caches.n == NCACHE)
+    panic("kmem_cache_create: too many");
+  c = &caches.cache[caches.n++];
+  release(&caches.lock);
+
+  c->name = name;
+  c->size = size;
+  c->perslab = (PGSIZE - SLABHDR) / size;
+  initlock(&c->lock, name);
+  return c;
+}
+
+static void
+partial_insert(struct kmem_cache *c, struct slab *s)
+{
+  s->prev = 0;
+  s->next = c->partial;
+  if(s->next)
+    s->next->prev = s;
+  c->partial = s;
+}
+
+static void
+partial_remove(struct kmem_cache *c, struct slab *s)
+{
+  if(s->prev)
+    s->prev->next = s->next;
+  else
+    c->partial = s->next;
+  if(s->next)
+    s->next->prev = s->prev;
+}
+
+// Allocate and carve a new slab for c.
+// Caller must hold c->lock.
+static struct slab*
+slab_grow(struct kmem_cache *c)
+{
+  struct slab *s;
+  char *obj;
+
+  if((s = (struct slab*)kalloc()) == 0)
+    return 0;
+  s->cache = c;
+  s->free = 0;
+  s->inuse = 0;
+  obj = (char*)s + SLABHDR + (c->perslab - 1) * c->size;
+  for(; obj >= (char*)s + SLABHDR; obj -= c->size){
+    *(void**)obj = s->free;
+    s->free = obj;
+  }
+  partial_insert(c, s);
+  c->nslab++;
+  return s;
+}
+
+// Move up to MAGSIZE/2 objects from the slabs into magazine m.
+// Interrupts must be disabled.
+static void
+mag_refill(struct kmem_cache *c, struct magazine *m)
+{
+  struct slab *s;
+  void *obj;
+
+  acquire(&c->lock);
+  while(m->n < MAGSIZE/2){
+    if((s = c->partial) == 0 && (s = slab_grow(c)) == 0)
+      break;
+    obj = s->free;
+    s->free = *(void**)obj;
+    s->inuse++;
+    if(s->free == 0)
+      partial_remove(c, s);
+    m->obj[m->n++] = obj;
+  }
+  release(&c->lock);
+}
+
+// Return MAGSIZE/2 objects from magazine m to their slabs.
+// Interrupts must be disabled.
+static void
+mag_flush(struct kmem_cache *c, struct magazine *m)
+{
+  struct slab *s;
+  void *obj;
+
+  acquire(&c->lock);
+  while(m->n > MAGSIZE/2){
+    obj = m->obj[--m->n];
+    s = (struct slab*)PGROUNDDOWN((uint64)obj);
+    if(s->free == 0)
+      partial_insert(c, s);
+    *(void**)obj = s->free;
+    s->free = obj;
+    s->inuse--;
+    if(s->inuse == 0 && (s->prev || s->next)){
+      partial_remove(c, s);
+      c->nslab--;
+      kfree((void*)s);
+    }
+  }
+  release(&c->lock);
+}
+
+// Allocate an object from cache c.
+// The object's contents are undefined.
+// Returns 0 if out of memory.
+void*
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  struct magazine *m;
+  void *obj = 0;
+
+  push_off();
+  m = &c->mag[cpuid()];
+  if(m->n == 0)
+    mag_refill(c, m);
+  if(m->n > 0)
+    obj = m->obj[--m->n];
+  pop_off();
+  return obj;
+}
+
+// Free an object returned by kmem_cache_alloc(c).
+void
+kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+  struct magazine *m;
+
+  if(((struct slab*)PGROUNDDOWN((uint64)obj))->cache != c)
+    panic("kmem_cache_free");
+
+  push_off();
+  m = &c->mag[cpuid()];
+  if(m->n == MAGSIZE)
+    mag_flush(c, m);
+  m->obj[m->n++] = obj;
+  pop_off();
+}
+
+// Print cache statistics to the console.
+// For debugging; runs from procdump() without locks.
+void
+slabdump(void)
+{
+  for(int i = 0; i < caches.n; i++){
+    struct kmem_cache *c = &caches.cache[i];
+    printf("slab %s: size %d slabs %d contended %u\n",
+           c->name, c->size, c->nslab, c->lock.nts);
+  }
+}
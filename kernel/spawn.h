@@ -0,0 +1,15 @@
+// File actions for spawn(), applied in order to a copy
+// of the caller's open files before the child runs.
+#define SPAWN_CLOSE 1  // close fd
+#define SPAWN_DUP2  2  // make fd a copy of srcfd
+#define SPAWN_OPEN  3  // open path with omode as fd
+
+#define NSPAWNACT  16  // max file actions per spawn()
+
+struct spawn_action {
+  int type;
+  int fd;
+  int srcfd;
+  int omode;
+  char *path;
+};
@@ -6,10 +6,17 @@
 
 void main();
 void timerinit();
+void ipiinit();
 
 // entry.S needs one stack per CPU.
 __attribute__ ((aligned (16))) char stack0[4096 * NCPU];
 
+// a scratch area per CPU for ipivec in kernelvec.S.
+uint64 ipi_scratch[NCPU][2];
+
+// in kernelvec.S.
+void ipivec();
+
 // entry.S jumps here in machine mode on stack0.
 void
 start()
@@ -30,7 +37,7 @@ start()
   // delegate all interrupts and exceptions to supervisor mode.
   w_medeleg(0xffff);
   w_mideleg(0xffff);
-  w_sie(r_sie() | SIE_SEIE | SIE_STIE);
+  w_sie(r_sie() | SIE_SEIE | SIE_STIE | SIE_SSIE);
 
   // configure Physical Memory Protection to give supervisor mode
   // access to all of physical memory.
@@ -40,6 +47,9 @@ start()
   // ask for clock interrupts.
   timerinit();
 
+  // let other CPUs interrupt this one with kick().
+  ipiinit();
+
   // keep each CPU's hartid in its tp register, for cpuid().
   int id = r_mhartid();
   w_tp(id);
@@ -58,9 +68,21 @@ timerinit()
   // enable the sstc extension (i.e. stimecmp).
   w_menvcfg(r_menvcfg() | (1L << 63)); 
   
-  // allow supervisor to use stimecmp and time.
-  w_mcounteren(r_mcounteren() | 2);
+  // allow supervisor to use stimecmp and time, and
+  // user programs (such as membench) to read cycle and time.
+  w_mcounteren(r_mcounteren() | COUNTEREN_CY | COUNTEREN_TM);
+  w_scounteren(COUNTEREN_CY | COUNTEREN_TM);
   
   // ask for the very first timer interrupt.
-  w_stimecmp(r_time() + 1000000);
+  w_stimecmp(r_time() + TICKTIME);
+}
+
+// machine software interrupts can't be delegated, so
+// ipivec turns each into a supervisor software interrupt.
+void
+ipiinit()
+{
+  w_mscratch((uint64)ipi_scratch[r_mhartid()]);
+  w_mtvec((uint64)ipivec);
+  w_mie(r_mie() | MIE_MSIE);
 }
@@ -1,13 +1,35 @@
 #include "types.h"
 
+// memset() and memmove() work a byte at a time up to an
+// 8-byte boundary, then 64 bytes (a cache line) at a time,
+// then a word at a time, then finish the tail in bytes.
+// memmove() uses words only if src and dst are equally
+// aligned; RISC-V traps or emulates misaligned accesses.
+
 void*
 memset(void *dst, int c, uint n)
 {
   char *cdst = (char *) dst;
-  int i;
-  for(i = 0; i < n; i++){
-    cdst[i] = c;
+  uint64 *wdst, w;
+
+  for(; n > 0 && (uint64)cdst % 8 != 0; n--)
+    *cdst++ = c;
+  if(n >= 8){
+    w = (uchar)c;
+    w |= w << 8;
+    w |= w << 16;
+    w |= w << 32;
+    wdst = (uint64 *) cdst;
+    for(; n >= 64; n -= 64, wdst += 8){
+      wdst[0] = w; wdst[1] = w; wdst[2] = w; wdst[3] = w;
+      wdst[4] = w; wdst[5] = w; wdst[6] = w; wdst[7] = w;
+    }
+    for(; n >= 8; n -= 8)
+      *wdst++ = w;
+    cdst = (char *) wdst;
   }
+  for(; n > 0; n--)
+    *cdst++ = c;
   return dst;
 }
 
@@ -32,20 +54,61 @@ memmove(void *dst, const void *src, uint n)
 {
   const char *s;
   char *d;
+  int words;
 
   if(n == 0)
     return dst;
   
   s = src;
   d = dst;
+  words = ((uint64)s ^ (uint64)d) % 8 == 0;
   if(s < d && s + n > d){
+    // overlapping, dst above src: copy backwards.
     s += n;
     d += n;
+    if(words){
+      for(; n > 0 && (uint64)d % 8 != 0; n--)
+        *--d = *--s;
+      for(; n >= 64; n -= 64){
+        d -= 64;
+        s -= 64;
+        ((uint64*)d)[7] = ((uint64*)s)[7];
+        ((uint64*)d)[6] = ((uint64*)s)[6];
+        ((uint64*)d)[5] = ((uint64*)s)[5];
+        ((uint64*)d)[4] = ((uint64*)s)[4];
+        ((uint64*)d)[3] = ((uint64*)s)[3];
+        ((uint64*)d)[2] = ((uint64*)s)[2];
+        ((uint64*)d)[1] = ((uint64*)s)[1];
+        ((uint64*)d)[0] = ((uint64*)s)[0];
+      }
+      for(; n >= 8; n -= 8){
+        d -= 8;
+        s -= 8;
+        *(uint64*)d = *(uint64*)s;
+      }
+    }
     while(n-- > 0)
       *--d = *--s;
-  } else
+  } else {
+    if(words){
+      for(; n > 0 && (uint64)d % 8 != 0; n--)
+        *d++ = *s++;
+      for(; n >= 64; n -= 64, d += 64, s += 64){
+        ((uint64*)d)[0] = ((uint64*)s)[0];
+        ((uint64*)d)[1] = ((uint64*)s)[1];
+        ((uint64*)d)[2] = ((uint64*)s)[2];
+        ((uint64*)d)[3] = ((uint64*)s)[3];
+        ((uint64*)d)[4] = ((uint64*)s)[4];
+        ((uint64*)d)[5] = ((uint64*)s)[5];
+        ((uint64*)d)[6] = ((uint64*)s)[6];
+        ((uint64*)d)[7] = ((uint64*)s)[7];
+      }
+      for(; n >= 8; n -= 8, d += 8, s += 8)
+        *(uint64*)d = *(uint64*)s;
+    }
     while(n-- > 0)
       *d++ = *s++;
+  }
 
   return dst;
 }
@@ -10,27 +10,24 @@
 #include "param.h"
 #include "stat.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "fs.h"
-#include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
+#include "spawn.h"
 
 // Fetch the nth word-sized system call argument as a file descriptor
-// and return both the descriptor and the corresponding struct file.
+// and return the corresponding struct file, which the caller must
+// give up with fdput(f, *put) (see fdget()).
 static int
-argfd(int n, int *pfd, struct file **pf)
+argfd(int n, struct file **pf, int *put)
 {
   int fd;
-  struct file *f;
 
   argint(n, &fd);
-  if(fd < 0 || fd >= NOFILE || (f=myproc()->ofile[fd]) == 0)
+  if((*pf = fdget(fd, put)) == 0)
     return -1;
-  if(pfd)
-    *pfd = fd;
-  if(pf)
-    *pf = f;
   return 0;
 }
 
@@ -40,28 +37,51 @@ static int
 fdalloc(struct file *f)
 {
   int fd;
-  struct proc *p = myproc();
+  struct files *fs = myproc()->files;
 
+  acquire(&fs->lock);
   for(fd = 0; fd < NOFILE; fd++){
-    if(p->ofile[fd] == 0){
-      p->ofile[fd] = f;
+    if(fs->ofile[fd] == 0){
+      fs->ofile[fd] = f;
+      release(&fs->lock);
       return fd;
     }
   }
+  release(&fs->lock);
   return -1;
 }
 
+// Take descriptor fd away from the process, and return
+// its file, whose reference passes to the caller.
+static struct file*
+fdfree(int fd)
+{
+  struct files *fs = myproc()->files;
+  struct file *f;
+
+  if(fd < 0 || fd >= NOFILE)
+    return 0;
+  acquire(&fs->lock);
+  f = fs->ofile[fd];
+  fs->ofile[fd] = 0;
+  release(&fs->lock);
+  return f;
+}
+
 uint64
 sys_dup(void)
 {
   struct file *f;
-  int fd;
+  int fd, put;
 
-  if(argfd(0, 0, &f) < 0)
+  if(argfd(0, &f, &put) < 0)
     return -1;
-  if((fd=fdalloc(f)) < 0)
+  if(!put)
+    filedup(f);
+  if((fd=fdalloc(f)) < 0){
+    fileclose(f);
     return -1;
-  filedup(f);
+  }
   return fd;
 }
 
@@ -71,12 +91,15 @@ sys_read(void)
   struct file *f;
   int n;
   uint64 p;
+  int r, put;
 
   argaddr(1, &p);
   argint(2, &n);
-  if(argfd(0, 0, &f) < 0)
+  if(argfd(0, &f, &put) < 0)
     return -1;
-  return fileread(f, p, n);
+  r = fileread(f, p, n);
+  fdput(f, put);
+  return r;
 }
 
 uint64
@@ -85,13 +108,16 @@ sys_write(void)
   struct file *f;
   int n;
   uint64 p;
+  int r, put;
   
   argaddr(1, &p);
   argint(2, &n);
-  if(argfd(0, 0, &f) < 0)
+  if(argfd(0, &f, &put) < 0)
     return -1;
 
-  return filewrite(f, p, n);
+  r = filewrite(f, p, n);
+  fdput(f, put);
+  return r;
 }
 
 uint64
@@ -100,9 +126,9 @@ sys_close(void)
   int fd;
   struct file *f;
 
-  if(argfd(0, &fd, &f) < 0)
+  argint(0, &fd);
+  if((f = fdfree(fd)) == 0)
     return -1;
-  myproc()->ofile[fd] = 0;
   fileclose(f);
   return 0;
 }
@@ -112,11 +138,14 @@ sys_fstat(void)
 {
   struct file *f;
   uint64 st; // user pointer to struct stat
+  int r, put;
 
   argaddr(1, &st);
-  if(argfd(0, 0, &f) < 0)
+  if(argfd(0, &f, &put) < 0)
     return -1;
-  return filestat(f, st);
+  r = filestat(f, st);
+  fdput(f, put);
+  return r;
 }
 
 // Create the path new as a link to the same inode as old.
@@ -301,18 +330,13 @@ create(char *path, short type, short major, short minor)
   return 0;
 }
 
-uint64
-sys_open(void)
+// Open path with mode omode for sys_open() and spawn().
+// Returns a new file with one reference, or 0.
+static struct file*
+fileopen(char *path, int omode)
 {
-  char path[MAXPATH];
-  int fd, omode;
   struct file *f;
   struct inode *ip;
-  int n;
-
-  argint(1, &omode);
-  if((n = argstr(0, path, MAXPATH)) < 0)
-    return -1;
 
   begin_op();
 
@@ -320,33 +344,31 @@ sys_open(void)
     ip = create(path, T_FILE, 0, 0);
     if(ip == 0){
       end_op();
-      return -1;
+      return 0;
     }
   } else {
     if((ip = namei(path)) == 0){
       end_op();
-      return -1;
+      return 0;
     }
     ilock(ip);
     if(ip->type == T_DIR && omode != O_RDONLY){
       iunlockput(ip);
       end_op();
-      return -1;
+      return 0;
     }
   }
 
   if(ip->type == T_DEVICE && (ip->major < 0 || ip->major >= NDEV)){
     iunlockput(ip);
     end_op();
-    return -1;
+    return 0;
   }
 
-  if((f = filealloc()) == 0 || (fd = fdalloc(f)) < 0){
-    if(f)
-      fileclose(f);
+  if((f = filealloc()) == 0){
     iunlockput(ip);
     end_op();
-    return -1;
+    return 0;
   }
 
   if(ip->type == T_DEVICE){
@@ -367,6 +389,26 @@ sys_open(void)
   iunlock(ip);
   end_op();
 
+  return f;
+}
+
+uint64
+sys_open(void)
+{
+  char path[MAXPATH];
+  int fd, omode;
+  struct file *f;
+
+  argint(1, &omode);
+  if(argstr(0, path, MAXPATH) < 0)
+    return -1;
+
+  if((f = fileopen(path, omode)) == 0)
+    return -1;
+  if((fd = fdalloc(f)) < 0){
+    fileclose(f);
+    return -1;
+  }
   return fd;
 }
 
@@ -376,8 +418,13 @@ sys_mkdir(void)
   char path[MAXPATH];
   struct inode *ip;
 
+  // fetch the path before begin_op(): a copy from user
+  // memory may wait for mm->lock, which filewrite() holds
+  // across begin_op().
+  if(argstr(0, path, MAXPATH) < 0)
+    return -1;
   begin_op();
-  if(argstr(0, path, MAXPATH) < 0 || (ip = create(path, T_DIR, 0, 0)) == 0){
+  if((ip = create(path, T_DIR, 0, 0)) == 0){
     end_op();
     return -1;
   }
@@ -393,11 +440,12 @@ sys_mknod(void)
   char path[MAXPATH];
   int major, minor;
 
-  begin_op();
   argint(1, &major);
   argint(2, &minor);
-  if((argstr(0, path, MAXPATH)) < 0 ||
-     (ip = create(path, T_DEVICE, major, minor)) == 0){
+  if((argstr(0, path, MAXPATH)) < 0)
+    return -1;
+  begin_op();
+  if((ip = create(path, T_DEVICE, major, minor)) == 0){
     end_op();
     return -1;
   }
@@ -410,11 +458,13 @@ uint64
 sys_chdir(void)
 {
   char path[MAXPATH];
-  struct inode *ip;
-  struct proc *p = myproc();
+  struct inode *ip, *old;
+  struct files *fs = myproc()->files;
   
+  if(argstr(0, path, MAXPATH) < 0)
+    return -1;
   begin_op();
-  if(argstr(0, path, MAXPATH) < 0 || (ip = namei(path)) == 0){
+  if((ip = namei(path)) == 0){
     end_op();
     return -1;
   }
@@ -425,26 +475,34 @@ sys_chdir(void)
     return -1;
   }
   iunlock(ip);
-  iput(p->cwd);
+  acquire(&fs->lock);
+  old = fs->cwd;
+  fs->cwd = ip;
+  release(&fs->lock);
+  iput(old);
   end_op();
-  p->cwd = ip;
   return 0;
 }
 
-uint64
-sys_exec(void)
+static void
+freeargv(char **argv)
+{
+  for(int i = 0; i < MAXARG && argv[i] != 0; i++)
+    kfree(argv[i]);
+}
+
+// Fetch the user argument vector at uargv into
+// kalloc()ed strings in argv[MAXARG].
+// On failure, frees what it fetched and returns -1.
+static int
+fetchargv(uint64 uargv, char **argv)
 {
-  char path[MAXPATH], *argv[MAXARG];
   int i;
-  uint64 uargv, uarg;
+  uint64 uarg;
 
-  argaddr(1, &uargv);
-  if(argstr(0, path, MAXPATH) < 0) {
-    return -1;
-  }
-  memset(argv, 0, sizeof(argv));
+  memset(argv, 0, MAXARG*sizeof(char*));
   for(i=0;; i++){
-    if(i >= NELEM(argv)){
+    if(i >= MAXARG){
       goto bad;
     }
     if(fetchaddr(uargv+sizeof(uint64)*i, (uint64*)&uarg) < 0){
@@ -460,17 +518,99 @@ sys_exec(void)
     if(fetchstr(uarg, argv[i], PGSIZE) < 0)
       goto bad;
   }
+  return 0;
 
-  int ret = kexec(path, argv);
+ bad:
+  freeargv(argv);
+  return -1;
+}
 
-  for(i = 0; i < NELEM(argv) && argv[i] != 0; i++)
-    kfree(argv[i]);
+uint64
+sys_exec(void)
+{
+  char path[MAXPATH], *argv[MAXARG];
+  uint64 uargv;
 
+  argaddr(1, &uargv);
+  if(argstr(0, path, MAXPATH) < 0) {
+    return -1;
+  }
+  if(fetchargv(uargv, argv) < 0)
+    return -1;
+
+  int ret = kexec(myproc(), path, argv);
+
+  freeargv(argv);
+  return ret;
+}
+
+// spawn(path, argv, actions, nactions): start path in a new
+// child, as fork() then exec() would, but without copying the
+// caller's memory. The child's open files are the caller's
+// after applying the file actions in order.
+uint64
+sys_spawn(void)
+{
+  char path[MAXPATH], apath[MAXPATH], *argv[MAXARG];
+  struct file *ofile[NOFILE], *f;
+  struct spawn_action act;
+  uint64 uargv, uact;
+  int i, nact;
+  struct proc *p = myproc();
+
+  argaddr(1, &uargv);
+  argaddr(2, &uact);
+  argint(3, &nact);
+  if(argstr(0, path, MAXPATH) < 0 || nact < 0 || nact > NSPAWNACT)
+    return -1;
+  if(fetchargv(uargv, argv) < 0)
+    return -1;
+
+  acquire(&p->files->lock);
+  for(i = 0; i < NOFILE; i++)
+    ofile[i] = p->files->ofile[i] ? filedup(p->files->ofile[i]) : 0;
+  release(&p->files->lock);
+
+  for(i = 0; i < nact; i++){
+    if(copyin(p->pagetable, (char*)&act, uact + i*sizeof(act), sizeof(act)) < 0)
+      goto bad;
+    if(act.fd < 0 || act.fd >= NOFILE)
+      goto bad;
+    switch(act.type){
+    case SPAWN_CLOSE:
+      f = 0;
+      break;
+    case SPAWN_DUP2:
+      if(act.srcfd < 0 || act.srcfd >= NOFILE || ofile[act.srcfd] == 0)
+        goto bad;
+      if(act.srcfd == act.fd)
+        continue;
+      f = filedup(ofile[act.srcfd]);
+      break;
+    case SPAWN_OPEN:
+      if(fetchstr((uint64)act.path, apath, MAXPATH) < 0)
+        goto bad;
+      if((f = fileopen(apath, act.omode)) == 0)
+        goto bad;
+      break;
+    default:
+      goto bad;
+    }
+    if(ofile[act.fd])
+      fileclose(ofile[act.fd]);
+    ofile[act.fd] = f;
+  }
+
+  int ret = kspawn(path, argv, ofile);
+
+  freeargv(argv);
   return ret;
 
  bad:
-  for(i = 0; i < NELEM(argv) && argv[i] != 0; i++)
-    kfree(argv[i]);
+  for(i = 0; i < NOFILE; i++)
+    if(ofile[i])
+      fileclose(ofile[i]);
+  freeargv(argv);
   return -1;
 }
 
@@ -488,15 +628,15 @@ sys_pipe(void)
   fd0 = -1;
   if((fd0 = fdalloc(rf)) < 0 || (fd1 = fdalloc(wf)) < 0){
     if(fd0 >= 0)
-      p->ofile[fd0] = 0;
+      fdfree(fd0);
     fileclose(rf);
     fileclose(wf);
     return -1;
   }
   if(copyout(p->pagetable, fdarray, (char*)&fd0, sizeof(fd0)) < 0 ||
      copyout(p->pagetable, fdarray+sizeof(fd0), (char *)&fd1, sizeof(fd1)) < 0){
-    p->ofile[fd0] = 0;
-    p->ofile[fd1] = 0;
+    fdfree(fd0);
+    fdfree(fd1);
     fileclose(rf);
     fileclose(wf);
     return -1;
@@ -4,8 +4,10 @@
 #include "param.h"
 #include "memlayout.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "vm.h"
+#include "fcntl.h"
 
 uint64
 sys_exit(void)
@@ -42,48 +44,182 @@ sys_sbrk(void)
   uint64 addr;
   int t;
   int n;
+  struct mm *mm = myproc()->mm;
 
   argint(0, &n);
   argint(1, &t);
-  addr = myproc()->sz;
+  acquiresleep(&mm->lock);
+  addr = mm->sz;
+
+  // don't grow into the mmap() regions.
+  if(n > 0 && addr + n > mmapbase(myproc()))
+    goto bad;
 
   if(t == SBRK_EAGER || n < 0) {
     if(growproc(n) < 0) {
-      return -1;
+      goto bad;
     }
   } else {
     // Lazily allocate memory for this process: increase its memory
     // size but don't allocate memory. If the processes uses the
     // memory, vmfault() will allocate it.
     if(addr + n < addr)
-      return -1;
-    myproc()->sz += n;
+      goto bad;
+    mm->sz += n;
   }
+  releasesleep(&mm->lock);
   return addr;
+
+ bad:
+  releasesleep(&mm->lock);
+  return -1;
 }
 
 uint64
 sys_pause(void)
 {
   int n;
-  uint ticks0;
 
   argint(0, &n);
   if(n < 0)
     n = 0;
-  acquire(&tickslock);
-  ticks0 = ticks;
-  while(ticks - ticks0 < n){
-    if(killed(myproc())){
-      release(&tickslock);
-      return -1;
-    }
-    sleep(&ticks, &tickslock);
-  }
-  release(&tickslock);
+  return sleepuntil(r_time() + (uint64)n * TICKTIME);
+}
+
+// int nice(int incr)
+// Add incr to the caller's nice value, which is kept between
+// 0 and NPRIO-1, and return the new value. A process never
+// runs at a priority level above its nice value.
+uint64
+sys_nice(void)
+{
+  struct proc *p = myproc();
+  int incr, nice;
+
+  argint(0, &incr);
+  if(incr < -NPRIO || incr > NPRIO)
+    incr = incr < 0 ? -NPRIO : NPRIO;
+  nice = p->nice + incr;
+  if(nice < 0)
+    nice = 0;
+  if(nice > NPRIO-1)
+    nice = NPRIO-1;
+  acquire(&p->lock);
+  p->nice = nice;
+  p->prio = nice;
+  p->slice = 0;
+  release(&p->lock);
+  return nice;
+}
+
+// int sched_setaffinity(int pid, uint64 mask)
+// Bit i of mask allows CPU i.
+uint64
+sys_sched_setaffinity(void)
+{
+  int pid;
+  uint64 mask;
+
+  argint(0, &pid);
+  argaddr(1, &mask);
+  return setaffinity(pid, mask);
+}
+
+// int sched_getaffinity(int pid, uint64 *mask)
+uint64
+sys_sched_getaffinity(void)
+{
+  int pid;
+  uint64 addr, mask;
+
+  argint(0, &pid);
+  argaddr(1, &addr);
+  if(getaffinity(pid, &mask, 0) < 0)
+    return -1;
+  if(copyout(myproc()->pagetable, addr, (char*)&mask, sizeof(mask)) < 0)
+    return -1;
   return 0;
 }
 
+// int nmigrate(int pid)
+// Returns the number of times pid has moved between CPUs.
+uint64
+sys_nmigrate(void)
+{
+  int pid, n;
+
+  argint(0, &pid);
+  if(getaffinity(pid, 0, &n) < 0)
+    return -1;
+  return n;
+}
+
+// int nanosleep(uint64 ns)
+uint64
+sys_nanosleep(void)
+{
+  uint64 ns;
+
+  argaddr(0, &ns);
+  if(ns > (uint64)1000000000 * 3600 * 24 * 365)
+    return -1;
+  // round up to whole time CSR ticks.
+  return sleepuntil(r_time() + (ns * (TIMEBASE / 1000000) + 999) / 1000);
+}
+
+// int clone(void (*fn)(void*), void *arg, void *stack)
+// stack is the top of the new thread's stack.
+uint64
+sys_clone(void)
+{
+  uint64 fn, arg, sp;
+
+  argaddr(0, &fn);
+  argaddr(1, &arg);
+  argaddr(2, &sp);
+  return kclone(fn, arg, sp);
+}
+
+// int texit(int status)
+// exit() ends every thread of the process; this, only the caller.
+uint64
+sys_texit(void)
+{
+  int n;
+  argint(0, &n);
+  ktexit(n);
+  return 0;  // not reached
+}
+
+// int join(int tid, int *status)
+uint64
+sys_join(void)
+{
+  int tid;
+  uint64 addr;
+
+  argint(0, &tid);
+  argaddr(1, &addr);
+  return kjoin(tid, addr);
+}
+
+// int futex(uint *addr, int op, int val)
+uint64
+sys_futex(void)
+{
+  uint64 addr;
+  int op, val;
+
+  argaddr(0, &addr);
+  argint(1, &op);
+  argint(2, &val);
+  if(op == FUTEX_WAIT)
+    return futexwait(addr, val);
+  if(op == FUTEX_WAKE)
+    return futexwake(addr, val);
+  return -1;
+}
+
 uint64
 sys_kill(void)
 {
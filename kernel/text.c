@@ -0,0 +1,210 @@
+//
+// Cache of program text pages, so that processes running
+// the same program map the same physical pages.
+//
+// A page is named by its file (dev, inum), its offset in the
+// file, and the number of file bytes it holds (the rest of
+// the page is zero). The cache holds one reference to each
+// page, and each page table that maps it another.
+//
+// Entries are added with the inode locked, and dropped when
+// the file is written or truncated, or when its inode leaves
+// the inode table; processes that already map a dropped page
+// keep it until they unmap it. The cache holds at most
+// NTEXTPAGE pages: adding one past that drops the least
+// recently used page that no page table maps, or, if every
+// page is mapped, leaves the new page uncached.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+
+#define NTEXTHASH 64
+#define TEXTHASH(dev, inum, off) \
+  (((dev) * 31 + (inum) * 17 + (off) / PGSIZE) % NTEXTHASH)
+
+struct tpage {
+  uint dev;
+  uint inum;
+  uint64 off;
+  uint n;
+  uint64 pa;
+  struct inode *ip;     // for ip->ntext
+  struct tpage *hnext;  // hash chain
+  struct tpage *prev;   // LRU list
+  struct tpage *next;
+};
+
+// text.lock protects the cache, and the ntext of every inode.
+static struct {
+  struct spinlock lock;
+  struct tpage *hash[NTEXTHASH];
+  // Linked list of all pages, through prev/next.
+  // head.next is most recently used, head.prev is least.
+  struct tpage head;
+  int npage;
+  int hits;
+  int evicts;
+} text;
+
+static struct kmem_cache *tpagecache;
+
+void
+textinit(void)
+{
+  initlock(&text.lock, "text");
+  text.head.prev = &text.head;
+  text.head.next = &text.head;
+  tpagecache = kmem_cache_create("text", sizeof(struct tpage));
+}
+
+static struct tpage*
+textlookup(struct inode *ip, uint64 off, uint n)
+{
+  struct tpage *t;
+
+  for(t = text.hash[TEXTHASH(ip->dev, ip->inum, off)]; t; t = t->hnext)
+    if(t->dev == ip->dev && t->inum == ip->inum && t->off == off && t->n == n)
+      return t;
+  return 0;
+}
+
+// Make t the most recently used page.
+// Caller must hold text.lock.
+static void
+textuse(struct tpage *t)
+{
+  if(t->next){
+    t->next->prev = t->prev;
+    t->prev->next = t->next;
+  }
+  t->next = text.head.next;
+  t->prev = &text.head;
+  text.head.next->prev = t;
+  text.head.next = t;
+}
+
+// Remove t from the cache and drop its reference to its page.
+// Caller must hold text.lock.
+static void
+textdrop(struct tpage *t)
+{
+  struct tpage **tp;
+
+  for(tp = &text.hash[TEXTHASH(t->dev, t->inum, t->off)]; *tp != t; tp = &(*tp)->hnext)
+    ;
+  *tp = t->hnext;
+  t->next->prev = t->prev;
+  t->prev->next = t->next;
+  t->ip->ntext--;
+  text.npage--;
+  kfree((void*)t->pa);
+  kmem_cache_free(tpagecache, t);
+}
+
+// Drop the least recently used page that no page table maps.
+// Returns 0 if there is none. Caller must hold text.lock.
+static int
+textevict(void)
+{
+  struct tpage *t;
+
+  for(t = text.head.prev; t != &text.head; t = t->prev){
+    if(krefcount((void*)t->pa) == 1){
+      textdrop(t);
+      text.evicts++;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Return the page holding n bytes of ip from off, reading
+// it in if it isn't cached, with a reference for the caller.
+// Caller must hold ip->lock. Returns 0 on error or if out
+// of memory.
+uint64
+textget(struct inode *ip, uint64 off, uint n)
+{
+  struct tpage *t;
+  uint64 pa;
+  char *mem;
+
+  acquire(&text.lock);
+  if((t = textlookup(ip, off, n)) != 0){
+    pa = t->pa;
+    kref((void*)pa);
+    text.hits++;
+    textuse(t);
+    release(&text.lock);
+    return pa;
+  }
+  release(&text.lock);
+
+  // ip->lock keeps anyone else from adding this page.
+  if((mem = kzalloc()) == 0)
+    return 0;
+  if(off < ip->size && readi(ip, 0, (uint64)mem, off, n) < 0){
+    kfree(mem);
+    return 0;
+  }
+  if((t = kmem_cache_alloc(tpagecache)) == 0)
+    return (uint64)mem;  // uncached, but usable
+  t->dev = ip->dev;
+  t->inum = ip->inum;
+  t->off = off;
+  t->n = n;
+  t->pa = (uint64)mem;
+  t->ip = ip;
+  t->next = 0;
+
+  acquire(&text.lock);
+  if(text.npage >= NTEXTPAGE && !textevict()){
+    release(&text.lock);
+    kmem_cache_free(tpagecache, t);
+    return (uint64)mem;  // uncached, but usable
+  }
+  kref(mem);  // for the caller
+  t->hnext = text.hash[TEXTHASH(ip->dev, ip->inum, off)];
+  text.hash[TEXTHASH(ip->dev, ip->inum, off)] = t;
+  textuse(t);
+  text.npage++;
+  ip->ntext++;
+  release(&text.lock);
+  return (uint64)mem;
+}
+
+// Drop ip's pages from the cache, because the file is
+// changing or its inode is leaving the inode table.
+// Caller must hold ip->lock, or otherwise know that no one
+// else is using ip.
+void
+textinval(struct inode *ip)
+{
+  struct tpage *t, *next;
+  int i;
+
+  acquire(&text.lock);
+  for(i = 0; i < NTEXTHASH && ip->ntext > 0; i++){
+    for(t = text.hash[i]; t; t = next){
+      next = t->hnext;
+      if(t->dev == ip->dev && t->inum == ip->inum)
+        textdrop(t);
+    }
+  }
+  release(&text.lock);
+}
+
+// Print cache statistics to the console.
+// For debugging; runs from procdump() without locks.
+void
+textdump(void)
+{
+  printf("text: pages %d hits %d evicts %d\n", text.npage, text.hits, text.evicts);
+}
@@ -0,0 +1,127 @@
+//
+// Sleeping until a deadline, for pause() and nanosleep().
+//
+// Sleeping processes are kept in a min-heap ordered by
+// deadline (in time CSR units). clockintr() wakes those
+// whose deadlines have passed, and asks for its next timer
+// interrupt no later than the earliest remaining deadline,
+// so a sleeper costs nothing until it is due, and may sleep
+// for less than a clock tick.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "defs.h"
+
+static struct {
+  struct spinlock lock;
+  int n;
+  struct proc *heap[NPROC];  // heap[0] has the earliest deadline
+} timers;
+
+void
+timersinit(void)
+{
+  initlock(&timers.lock, "timers");
+}
+
+static void
+place(int i, struct proc *p)
+{
+  timers.heap[i] = p;
+  p->timeridx = i + 1;
+}
+
+// Move the process at i up or down to its place in the heap.
+static void
+fix(int i)
+{
+  struct proc *p = timers.heap[i];
+  int c;
+
+  while(i > 0 && timers.heap[(i-1)/2]->deadline > p->deadline){
+    place(i, timers.heap[(i-1)/2]);
+    i = (i-1)/2;
+  }
+  while((c = 2*i + 1) < timers.n){
+    if(c + 1 < timers.n && timers.heap[c+1]->deadline < timers.heap[c]->deadline)
+      c++;
+    if(timers.heap[c]->deadline >= p->deadline)
+      break;
+    place(i, timers.heap[c]);
+    i = c;
+  }
+  place(i, p);
+}
+
+static void
+insert(struct proc *p)
+{
+  place(timers.n++, p);
+  fix(timers.n - 1);
+}
+
+static void
+remove(struct proc *p)
+{
+  int i = p->timeridx - 1;
+
+  p->timeridx = 0;
+  if(--timers.n > i){
+    place(i, timers.heap[timers.n]);
+    fix(i);
+  }
+}
+
+// Sleep until the time CSR reaches deadline.
+// Returns 0, or -1 if the process was killed.
+int
+sleepuntil(uint64 deadline)
+{
+  struct proc *p = myproc();
+  int r = 0;
+
+  acquire(&timers.lock);
+  if(r_time() < deadline){
+    p->deadline = deadline;
+    insert(p);
+    // have this CPU's timer go off in time. (timers.lock
+    // keeps interrupts off, and so this CPU.)
+    if(deadline < r_stimecmp())
+      w_stimecmp(deadline);
+    while(p->timeridx){
+      if(killed(p)){
+        remove(p);
+        r = -1;
+        break;
+      }
+      sleep(&p->deadline, &timers.lock);
+    }
+  }
+  release(&timers.lock);
+  return r;
+}
+
+// Wake the processes whose deadlines are no later than now.
+// Returns the earliest remaining deadline, or ~0 if none.
+// Called from clockintr().
+uint64
+timerexpire(uint64 now)
+{
+  struct proc *p;
+  uint64 next;
+
+  acquire(&timers.lock);
+  while(timers.n > 0 && (p = timers.heap[0])->deadline <= now){
+    remove(p);
+    wakeup(&p->deadline);
+  }
+  next = timers.n > 0 ? timers.heap[0]->deadline : ~0UL;
+  release(&timers.lock);
+  return next;
+}
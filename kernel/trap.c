@@ -3,11 +3,13 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "defs.h"
 
 struct spinlock tickslock;
 uint ticks;
+static uint64 boottime;
 
 extern char trampoline[], uservec[];
 
@@ -20,6 +22,7 @@ void
 trapinit(void)
 {
   initlock(&tickslock, "time");
+  boottime = r_time();
 }
 
 // set up to take exceptions and traps while in the kernel.
@@ -68,9 +71,18 @@ usertrap(void)
     syscall();
   } else if((which_dev = devintr()) != 0){
     // ok
-  } else if((r_scause() == 15 || r_scause() == 13) &&
-            vmfault(p->pagetable, r_stval(), (r_scause() == 13)? 1 : 0) != 0) {
-    // page fault on lazily-allocated page
+  } else if(r_scause() == 15 || r_scause() == 13 || r_scause() == 12){
+    // page fault on a lazily-allocated, copy-on-write, or
+    // mmap()ed page, or on program text not yet read in.
+    // Reading a mapped file may sleep, so enable interrupts,
+    // having saved the trap registers.
+    uint64 scause = r_scause(), stval = r_stval();
+    intr_on();
+    if(vmfault(p->pagetable, stval, scause != 15) == 0){
+      printf("usertrap(): unexpected scause 0x%lx pid=%d\n", scause, p->pid);
+      printf("            sepc=0x%lx stval=0x%lx\n", p->trapframe->epc, stval);
+      setkilled(p);
+    }
   } else {
     printf("usertrap(): unexpected scause 0x%lx pid=%d\n", r_scause(), p->pid);
     printf("            sepc=0x%lx stval=0x%lx\n", r_sepc(), r_stval());
@@ -80,14 +92,14 @@ usertrap(void)
   if(killed(p))
     kexit(-1);
 
-  // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2)
+  // give up the CPU if the clock says it's time.
+  if(which_dev == 2 && p->resched)
     yield();
 
   prepare_return();
 
   // the user page table to switch to, for trampoline.S
-  uint64 satp = MAKE_SATP(p->pagetable);
+  uint64 satp = procsatp(p);
 
   // return to trampoline.S; satp value in a0.
   return satp;
@@ -117,6 +129,9 @@ prepare_return(void)
   p->trapframe->kernel_trap = (uint64)usertrap;
   p->trapframe->kernel_hartid = r_tp();         // hartid for cpuid()
 
+  // where uservec and userret find the trapframe.
+  w_sscratch(THREADFRAME(p->tfslot));
+
   // set up the registers that trampoline.S's sret will use
   // to get to user space.
   
@@ -151,8 +166,8 @@ kerneltrap()
     panic("kerneltrap");
   }
 
-  // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2 && myproc() != 0)
+  // give up the CPU if the clock says it's time.
+  if(which_dev == 2 && myproc() != 0 && myproc()->resched)
     yield();
 
   // the yield() may have caused some traps to occur,
@@ -161,20 +176,67 @@ kerneltrap()
   w_sstatus(sstatus);
 }
 
+// Bring ticks up to date with the time CSR. Every CPU
+// that is ticking does this, so ticks keeps counting
+// while any one of them sleeps through its ticks.
+static void
+tickupdate(uint64 now)
+{
+  uint t = (now - boottime) / TICKTIME;
+
+  acquire(&tickslock);
+  if(t > ticks)
+    ticks = t;
+  release(&tickslock);
+}
+
+// An idle CPU has found something to run; start its
+// clock tick again. Called by scheduler() with
+// interrupts off.
+void
+tickresume(void)
+{
+  struct cpu *c = mycpu();
+  uint64 now = r_time();
+
+  tickupdate(now);
+  c->nexttick = now + TICKTIME;
+  if(c->nexttick < r_stimecmp())
+    w_stimecmp(c->nexttick);
+}
+
 void
 clockintr()
 {
-  if(cpuid() == 0){
-    acquire(&tickslock);
-    ticks++;
-    wakeup(&ticks);
-    release(&tickslock);
+  struct cpu *c = mycpu();
+  uint64 now = r_time(), next;
+
+  // an idle CPU has no clock tick, and wakes only for
+  // sleepers' deadlines.
+  if(c->idle){
+    w_stimecmp(timerexpire(now));
+    return;
   }
 
+  // the interrupt may be for a sleeper's deadline
+  // rather than for this CPU's clock tick.
+  if(now >= c->nexttick){
+    tickupdate(now);
+    c->nexttick = now + TICKTIME;
+    schedtick();
+  }
+  next = timerexpire(now);
+
   // ask for the next timer interrupt. this also clears
-  // the interrupt request. 1000000 is about a tenth
-  // of a second.
-  w_stimecmp(r_time() + 1000000);
+  // the interrupt request.
+  w_stimecmp(next < c->nexttick ? next : c->nexttick);
+}
+
+// Interrupt CPU id, to wake it from wfi.
+void
+kick(int id)
+{
+  *(volatile uint32*)CLINT_MSIP(id) = 1;
 }
 
 // check if it's an external interrupt or software interrupt,
@@ -212,6 +274,11 @@ devintr()
     // timer interrupt.
     clockintr();
     return 2;
+  } else if(scause == 0x8000000000000001L){
+    // software interrupt, from kick() by way of ipivec.
+    w_sip(r_sip() & ~SIP_SSIP);
+    tlbpoll();
+    return 1;
   } else {
     return 0;
   }
@@ -178,7 +178,6 @@ free_desc(int i)
   disk.desc[i].flags = 0;
   disk.desc[i].next = 0;
   disk.free[i] = 1;
-  wakeup(&disk.free[0]);
 }
 
 // free a chain of descriptors.
@@ -194,6 +193,9 @@ free_chain(int i)
     else
       break;
   }
+  // a request needs three descriptors, as many as
+  // were just freed: wake one waiting request.
+  wakeup_one(&disk.free[0]);
 }
 
 // allocate three descriptors (they need not be contiguous).
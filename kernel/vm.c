@@ -5,6 +5,7 @@
 #include "riscv.h"
 #include "defs.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
 #include "fs.h"
 
@@ -17,14 +18,18 @@ extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
 
+#define SUPERORDER 9  // kalloc_order() of a 2MB superpage
+
+// nonzero if some byte of the 64-bit word w is zero.
+#define HASZERO(w) (((w) - 0x0101010101010101UL) & ~(w) & 0x8080808080808080UL)
+
 // Make a direct-map page table for the kernel.
 pagetable_t
 kvmmake(void)
 {
   pagetable_t kpgtbl;
 
-  kpgtbl = (pagetable_t) kalloc();
-  memset(kpgtbl, 0, PGSIZE);
+  kpgtbl = (pagetable_t) kzalloc();
 
   // uart registers
   kvmmap(kpgtbl, UART0, UART0, PGSIZE, PTE_R | PTE_W);
@@ -32,6 +37,9 @@ kvmmake(void)
   // virtio mmio disk interface
   kvmmap(kpgtbl, VIRTIO0, VIRTIO0, PGSIZE, PTE_R | PTE_W);
 
+  // CLINT, for kick()
+  kvmmap(kpgtbl, CLINT, CLINT, 0x10000, PTE_R | PTE_W);
+
   // PLIC
   kvmmap(kpgtbl, PLIC, PLIC, 0x4000000, PTE_R | PTE_W);
 
@@ -45,20 +53,39 @@ kvmmake(void)
   // the highest virtual address in the kernel.
   kvmmap(kpgtbl, TRAMPOLINE, (uint64)trampoline, PGSIZE, PTE_R | PTE_X);
 
-  // allocate and map a kernel stack for each process.
-  proc_mapstacks(kpgtbl);
-  
+  // page-table pages for the kernel stacks, which newproc()
+  // maps as it creates proc structures.
+  for(int i = 0; i < NPROC; i++)
+    if(walk(kpgtbl, KSTACK(i), 1) == 0)
+      panic("kvmmake");
+
   return kpgtbl;
 }
 
 // add a mapping to the kernel page table.
-// only used when booting.
+// uses 2MB level-1 leaves where va and pa are both
+// suitably aligned, and 4KB pages elsewhere.
+// used when booting, and by newproc() for kernel stacks,
+// whose page-table pages kvmmake() has already made.
 // does not flush TLB or enable paging.
 void
 kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
 {
-  if(mappages(kpgtbl, va, sz, pa, perm) != 0)
-    panic("kvmmap");
+  uint64 a, n;
+  pte_t *pte;
+
+  for(a = va; a < va + sz; a += n, pa += n){
+    if(a % SUPERPGSIZE == 0 && pa % SUPERPGSIZE == 0 && va + sz - a >= SUPERPGSIZE){
+      n = SUPERPGSIZE;
+      if((pte = walklevel(kpgtbl, a, 1, 1)) == 0 || (*pte & PTE_V))
+        panic("kvmmap");
+      *pte = PA2PTE(pa) | perm | PTE_V;
+    } else {
+      n = PGSIZE;
+      if(mappages(kpgtbl, a, PGSIZE, pa, perm) != 0)
+        panic("kvmmap");
+    }
+  }
 }
 
 // Initialize the kernel_pagetable, shared by all CPUs.
@@ -76,7 +103,7 @@ kvminithart()
   // wait for any previous writes to the page table memory to finish.
   sfence_vma();
 
-  w_satp(MAKE_SATP(kernel_pagetable));
+  w_satp(MAKE_SATP(kernel_pagetable, 0));
 
   // flush stale entries from the TLB.
   sfence_vma();
@@ -94,24 +121,246 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+//
+// A leaf PTE at level 1 maps a 2MB superpage; walk()
+// returns such a PTE rather than descending past it.
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
+{
+  return walklevel(pagetable, va, 0, alloc);
+}
+
+// Like walk(), but return the PTE at the given level
+// (0 for 4KB pages, 1 for 2MB superpages), or a leaf
+// PTE found above that level.
+pte_t *
+walklevel(pagetable_t pagetable, uint64 va, int level, int alloc)
 {
   if(va >= MAXVA)
     panic("walk");
 
-  for(int level = 2; level > 0; level--) {
-    pte_t *pte = &pagetable[PX(level, va)];
+  for(int l = 2; l > level; l--) {
+    pte_t *pte = &pagetable[PX(l, va)];
     if(*pte & PTE_V) {
+      if(PTE_LEAF(*pte))
+        return pte;
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      if(!alloc || (pagetable = (pde_t*)kzalloc()) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
-  return &pagetable[PX(0, va)];
+  return &pagetable[PX(level, va)];
+}
+
+// Return the level-1 leaf PTE if va lies in a 2MB
+// superpage, or 0.
+static pte_t *
+superpte(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+
+  if((pte = walklevel(pagetable, va, 1, 0)) == 0)
+    return 0;
+  if((*pte & PTE_V) && PTE_LEAF(*pte))
+    return pte;
+  return 0;
+}
+
+// Discard this CPU's TLB entry for user address va, after
+// changing its PTE in pagetable, if pagetable is the running
+// process's. Other CPUs discard theirs before a thread using
+// pagetable next returns to user space on them (see procsatp());
+// a CPU running such a thread now may use the old entry until
+// tlbshootdown(), which callers use before freeing the memory
+// it refers to or relying on a permission it no longer has.
+// Processes without ASIDs have their entries flushed on every
+// return to user space.
+static void
+uvmflush(pagetable_t pagetable, uint64 va)
+{
+  struct proc *p = myproc();
+  struct mm *mm;
+  uint64 me;
+
+  if(p == 0 || (mm = p->mm) == 0 || mm->pagetable != pagetable)
+    return;
+  if(mm->asid)
+    sfence_vma_page(va, mm->asid & ASIDMASK);
+
+  push_off();
+  me = 1UL << cpuid();
+  pop_off();
+  if((mm->tlbcpus & ~me) == 0)
+    return;
+  __sync_fetch_and_and(&mm->tlbcpus, me);
+}
+
+// Wait until no other CPU running a thread of pagetable's
+// address space can still use a TLB entry from before the
+// caller's uvmflush() calls. Each such CPU is interrupted,
+// and flushes its whole TLB in tlbpoll(). A CPU that starts
+// running the address space later flushes in procsatp(), since
+// uvmflush() cleared its bit in tlbcpus before this looks at
+// cpus[].proc, and the CPU sets cpus[].proc before looking at
+// its bit.
+void
+tlbshootdown(pagetable_t pagetable)
+{
+  struct proc *p = myproc(), *q;
+  struct mm *mm;
+  uint64 want[NCPU];
+  int i, me;
+
+  if(p == 0 || (mm = p->mm) == 0 || mm->pagetable != pagetable || mm->ref == 1)
+    return;
+
+  push_off();
+  me = cpuid();
+  __sync_synchronize();
+  for(i = 0; i < NCPU; i++){
+    want[i] = 0;
+    if(i != me && (q = cpus[i].proc) != 0 && q->mm == mm){
+      want[i] = __sync_add_and_fetch(&cpus[i].tlbreq, 1);
+      kick(i);
+    }
+  }
+  // keep answering other CPUs' requests while waiting,
+  // in case they are waiting for this one.
+  for(i = 0; i < NCPU; i++)
+    while(want[i] && cpus[i].tlbdone < want[i])
+      tlbpoll();
+  pop_off();
+}
+
+// Flush this CPU's TLB if tlbshootdown() has asked it to.
+// Called with interrupts off, from devintr() and while
+// spinning in acquire().
+void
+tlbpoll(void)
+{
+  struct cpu *c = mycpu();
+  uint64 req = c->tlbreq;
+
+  if(c->tlbdone != req){
+    sfence_vma();
+    __sync_synchronize();
+    c->tlbdone = req;
+  }
+}
+
+// Fill the page-table page pt with 4KB PTEs that map the
+// memory of the superpage leaf PTE leaf with the same
+// permissions. The memory becomes separately freed pages.
+static void
+superfill(pagetable_t pt, pte_t leaf)
+{
+  uint64 pa = PTE2PA(leaf);
+  uint flags = PTE_FLAGS(leaf);
+
+  ksplit((void*)pa, SUPERORDER);
+  for(int i = 0; i < 512; i++)
+    pt[i] = PA2PTE(pa + i*PGSIZE) | flags;
+}
+
+// Replace the superpage leaf *pte with the page-table page
+// pt, filled to map the same memory (see superfill()).
+static void
+demote(pte_t *pte, pagetable_t pt)
+{
+  superfill(pt, *pte);
+  *pte = PA2PTE(pt) | PTE_V;
+}
+
+// Make the superpage leaf *pte, which maps va's 2MB region,
+// refer to memory that pagetable alone maps, copying the
+// memory if it is shared, and writable if it was copy-on-write.
+// Without a free 2MB block the copy is made in 4KB pages,
+// and *pte then points to a page-table page.
+// Returns 0, or -1 if out of memory.
+static int
+superown(pagetable_t pagetable, uint64 va, pte_t *pte)
+{
+  uint64 pa = PTE2PA(*pte);
+  uint flags = PTE_FLAGS(*pte);
+  pagetable_t pt;
+  char *mem;
+  int i;
+
+  if(flags & PTE_COW)
+    flags = (flags & ~PTE_COW) | PTE_W;
+  if(krefcount((void*)pa) == 1){
+    *pte = PA2PTE(pa) | flags;
+    uvmflush(pagetable, va);
+    return 0;
+  }
+  if((mem = kalloc_order(SUPERORDER)) != 0){
+    memmove(mem, (char*)pa, SUPERPGSIZE);
+    *pte = PA2PTE(mem) | flags;
+  } else {
+    if((pt = (pagetable_t)kzalloc()) == 0)
+      return -1;
+    for(i = 0; i < 512; i++){
+      if((mem = kalloc()) == 0){
+        while(--i >= 0)
+          kfree((void*)PTE2PA(pt[i]));
+        kfree(pt);
+        return -1;
+      }
+      memmove(mem, (char*)pa + i*PGSIZE, PGSIZE);
+      pt[i] = PA2PTE(mem) | flags;
+    }
+    *pte = PA2PTE(pt) | PTE_V;
+  }
+  uvmflush(pagetable, va);
+  tlbshootdown(pagetable);
+  kfree_order((void*)pa, SUPERORDER);
+  return 0;
+}
+
+// A translation cache for one copy to or from user memory.
+// It remembers the level-1 PTE of the 2MB region last used,
+// so that each further page in that region costs one index
+// into its last-level table rather than a walk. The PTE
+// itself is re-read every time, since a fault may change it.
+struct ucache {
+  pagetable_t pagetable;
+  uint64 region;    // SUPERPGROUNDDOWN of the cached address
+  pte_t *l1;        // level-1 PTE for region, or 0
+};
+
+// Look up user page va0 through c. Returns the physical
+// address, or 0 if not mapped; sets *ptep to the leaf PTE.
+static uint64
+ulookup(struct ucache *c, uint64 va0, pte_t **ptep)
+{
+  pte_t *pte;
+  uint64 off;
+
+  if(va0 >= MAXVA)
+    return 0;
+  if(c->l1 == 0 || SUPERPGROUNDDOWN(va0) != c->region){
+    if((c->l1 = walklevel(c->pagetable, va0, 1, 0)) == 0)
+      return 0;
+    c->region = SUPERPGROUNDDOWN(va0);
+  }
+  pte = c->l1;
+  if((*pte & PTE_V) == 0)
+    return 0;
+  if(PTE_LEAF(*pte)){
+    off = PGROUNDDOWN(va0) % SUPERPGSIZE;  // in a superpage
+  } else {
+    pte = &((pagetable_t)PTE2PA(*pte))[PX(0, va0)];
+    off = 0;
+  }
+  if((*pte & PTE_V) == 0)
+    return 0;
+  if((*pte & PTE_U) == 0)
+    return 0;
+  if(ptep)
+    *ptep = pte;
+  return PTE2PA(*pte) + off;
 }
 
 // Look up a virtual address, return the physical address,
@@ -120,21 +369,120 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
 uint64
 walkaddr(pagetable_t pagetable, uint64 va)
 {
-  pte_t *pte;
-  uint64 pa;
+  struct ucache c = { pagetable, 0, 0 };
 
-  if(va >= MAXVA)
+  return ulookup(&c, PGROUNDDOWN(va), 0);
+}
+
+static uint64 fault(pagetable_t, uint64, int);
+
+// Lock the address space that pagetable belongs to for a copy
+// to or from user memory, if it is the current process's and
+// other threads share it, so that they can't unmap the pages,
+// or break copy-on-write, under the copy. The caller must hold
+// no spinlocks. Returns the mm locked, or 0 if there was no
+// need, or the caller holds the lock already (see uvmpin()).
+static struct mm*
+copylock(pagetable_t pagetable)
+{
+  struct proc *p = myproc();
+  struct mm *mm;
+
+  if(p == 0 || (mm = p->mm) == 0 || mm->pagetable != pagetable || mm->ref == 1)
     return 0;
+  if(holdingsleep(&mm->lock))
+    return 0;
+  acquiresleep(&mm->lock);
+  return mm;
+}
 
-  pte = walk(pagetable, va, 0);
-  if(pte == 0)
+static void
+copyunlock(struct mm *mm)
+{
+  if(mm)
+    releasesleep(&mm->lock);
+}
+
+// Fault in user page va0 for a copy, with the address space
+// locked by copylock() if mm isn't 0.
+static uint64
+copyfault(struct mm *mm, pagetable_t pagetable, uint64 va0, int read)
+{
+  if(mm || holdingsleep(&myproc()->mm->lock))
+    return fault(pagetable, va0, read);
+  return vmfault(pagetable, va0, read);
+}
+
+static uint64
+writeaddr(struct mm *mm, pagetable_t pagetable, uint64 va)
+{
+  struct ucache c = { pagetable, 0, 0 };
+  uint64 va0 = PGROUNDDOWN(va), pa0;
+  pte_t *pte;
+
+  if((pa0 = ulookup(&c, va0, &pte)) == 0){
+    if(copyfault(mm, pagetable, va0, 0) == 0 || (pa0 = ulookup(&c, va0, &pte)) == 0)
+      return 0;
+  }
+  if((*pte & PTE_COW) &&
+     (uvmcow(pagetable, va0) == 0 || (pa0 = ulookup(&c, va0, &pte)) == 0))
     return 0;
-  if((*pte & PTE_V) == 0)
+  if((*pte & PTE_W) == 0)
     return 0;
-  if((*pte & PTE_U) == 0)
+  return pa0 + (va - va0);
+}
+
+// Return the physical address behind user address va, for
+// the kernel to write: faulted in, and with copy-on-write
+// broken, so that the page is the caller's own.
+// pagetable must be the current process's, and the caller
+// must hold its mm->lock.
+// Returns 0 if va isn't mapped writable.
+uint64
+uvmwriteaddr(pagetable_t pagetable, uint64 va)
+{
+  return writeaddr(myproc()->mm, pagetable, va);
+}
+
+// Get the current process's user memory [va, va+len) ready
+// for copyout() (if write) or copyin() with an inode locked,
+// as fileread() and filewrite() do: lock the address space if
+// other threads share it, so that they can't unmap the pages,
+// and fault the pages in, breaking copy-on-write if write, so
+// that the copy doesn't fault. A fault may need the inode
+// lock, and the lock order is mm->lock, then ip->lock.
+// Returns how many bytes from va are ready. The caller must
+// call uvmunpin() when done.
+uint64
+uvmpin(pagetable_t pagetable, uint64 va, uint64 len, int write)
+{
+  struct ucache c = { pagetable, 0, 0 };
+  struct mm *mm = myproc()->mm;
+  uint64 a;
+
+  if(mm->ref > 1)
+    acquiresleep(&mm->lock);
+  for(a = PGROUNDDOWN(va); a < va + len; a += PGSIZE){
+    if(write){
+      if(writeaddr(0, pagetable, a) == 0)
+        break;
+    } else if(ulookup(&c, a, 0) == 0){
+      if(copyfault(0, pagetable, a, 1) == 0 || ulookup(&c, a, 0) == 0)
+        break;
+    }
+  }
+  if(a <= va)
     return 0;
-  pa = PTE2PA(*pte);
-  return pa;
+  return a - va < len ? a - va : len;
+}
+
+void
+uvmunpin(void)
+{
+  struct mm *mm = myproc()->mm;
+
+  if(holdingsleep(&mm->lock))
+    releasesleep(&mm->lock);
 }
 
 // Create PTEs for virtual addresses starting at va that refer to
@@ -165,6 +513,7 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
     if(*pte & PTE_V)
       panic("mappages: remap");
     *pte = PA2PTE(pa) | perm | PTE_V;
+    uvmflush(pagetable, a);
     if(a == last)
       break;
     a += PGSIZE;
@@ -179,36 +528,129 @@ pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kzalloc();
   if(pagetable == 0)
     return 0;
-  memset(pagetable, 0, PGSIZE);
   return pagetable;
 }
 
+// Memory that uvmunmap() has unmapped, to be freed in batches
+// once no other CPU's TLB can refer to it.
+#define NUNMAPFREE 32
+
+struct unmapfree {
+  int n;
+  uint64 pa[NUNMAPFREE];
+  int order[NUNMAPFREE];
+};
+
+static void
+unmapflush(pagetable_t pagetable, struct unmapfree *uf)
+{
+  tlbshootdown(pagetable);
+  for(int i = 0; i < uf->n; i++)
+    kfree_order((void*)uf->pa[i], uf->order[i]);
+  uf->n = 0;
+}
+
+static void
+unmapfree(pagetable_t pagetable, struct unmapfree *uf, uint64 pa, int order)
+{
+  if(uf->n == NUNMAPFREE)
+    unmapflush(pagetable, uf);
+  uf->pa[uf->n] = pa;
+  uf->order[uf->n++] = order;
+}
+
 // Remove npages of mappings starting from va. va must be
 // page-aligned. It's OK if the mappings don't exist.
 // Optionally free the physical memory.
+// Other threads' CPUs have stopped using the mappings by
+// the time it returns.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
-  uint64 a;
-  pte_t *pte;
+  struct unmapfree uf;
+  uint64 a, end;
+  pte_t *pte, leaf;
+  pagetable_t pt;
+  int unmapped = 0;
 
   if((va % PGSIZE) != 0)
     panic("uvmunmap: not aligned");
 
-  for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
+  uf.n = 0;
+  end = va + npages*PGSIZE;
+  for(a = va; a < end; a += PGSIZE){
+    if((pte = superpte(pagetable, a)) != 0){
+      if(a % SUPERPGSIZE == 0 && a + SUPERPGSIZE <= end){
+        // the whole superpage goes.
+        leaf = *pte;
+        *pte = 0;
+        uvmflush(pagetable, a);
+        unmapped = 1;
+        if(do_free)
+          unmapfree(pagetable, &uf, PTE2PA(leaf), SUPERORDER);
+        a += SUPERPGSIZE - PGSIZE;
+        continue;
+      }
+      // demote it, and unmap its pages one by one. a
+      // shared superpage can't be split; uvmdealloc()
+      // copies one before unmapping part of it.
+      if(krefcount((void*)PTE2PA(*pte)) > 1)
+        panic("uvmunmap: shared superpage");
+      if((pt = (pagetable_t)kzalloc()) == 0){
+        if(!do_free)
+          panic("uvmunmap: demote");
+        // out of memory: the page at a is being freed,
+        // so use it as the page-table page, once no CPU
+        // can write to it through the superpage.
+        leaf = *pte;
+        *pte = 0;
+        uvmflush(pagetable, a);
+        tlbshootdown(pagetable);
+        pt = (pagetable_t)(PTE2PA(leaf) + a % SUPERPGSIZE);
+        superfill(pt, leaf);
+        pt[PX(0, a)] = 0;
+        *pte = PA2PTE(pt) | PTE_V;
+        continue;
+      }
+      demote(pte, pt);
+      uvmflush(pagetable, a);
+    }
     if((pte = walk(pagetable, a, 0)) == 0) // leaf page table entry allocated?
       continue;   
     if((*pte & PTE_V) == 0)  // has physical page been allocated?
       continue;
-    if(do_free){
-      uint64 pa = PTE2PA(*pte);
-      kfree((void*)pa);
-    }
+    leaf = *pte;
     *pte = 0;
+    uvmflush(pagetable, a);
+    unmapped = 1;
+    if(do_free)
+      unmapfree(pagetable, &uf, PTE2PA(leaf), 0);
   }
+  if(unmapped)
+    unmapflush(pagetable, &uf);
+}
+
+// Map a zeroed 2MB superpage at va, which must be
+// aligned and have nothing mapped in its 2MB.
+// Returns the physical address, or 0 if no 2MB
+// block is free.
+static uint64
+superalloc(pagetable_t pagetable, uint64 va, int perm)
+{
+  pte_t *pte;
+  char *mem;
+
+  if((pte = walklevel(pagetable, va, 1, 1)) == 0 || *pte != 0)
+    return 0;
+  if((mem = kalloc_order(SUPERORDER)) == 0)
+    return 0;
+  memset(mem, 0, SUPERPGSIZE);
+  *pte = PA2PTE(mem) | perm | PTE_V;
+  uvmflush(pagetable, va);
+  return (uint64)mem;
 }
 
 // Allocate PTEs and physical memory to grow a process from oldsz to
@@ -224,12 +666,16 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    if(a % SUPERPGSIZE == 0 && a + SUPERPGSIZE <= newsz &&
+       superalloc(pagetable, a, PTE_R|PTE_U|xperm) != 0){
+      a += SUPERPGSIZE - PGSIZE;
+      continue;
+    }
+    mem = kzalloc();
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_R|PTE_U|xperm) != 0){
       kfree(mem);
       uvmdealloc(pagetable, a, oldsz);
@@ -242,7 +688,8 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 // Deallocate user pages to bring the process size from oldsz to
 // newsz.  oldsz and newsz need not be page-aligned, nor does newsz
 // need to be less than oldsz.  oldsz can be larger than the actual
-// process size.  Returns the new process size.
+// process size.  Returns the new process size, or oldsz if out of
+// memory to copy a shared superpage that newsz splits.
 uint64
 uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 {
@@ -250,6 +697,11 @@ uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
     return oldsz;
 
   if(PGROUNDUP(newsz) < PGROUNDUP(oldsz)){
+    pte_t *pte = superpte(pagetable, PGROUNDUP(newsz));
+    if(pte && PGROUNDUP(newsz) % SUPERPGSIZE != 0 &&
+       krefcount((void*)PTE2PA(*pte)) > 1 &&
+       superown(pagetable, PGROUNDUP(newsz), pte) < 0)
+      return oldsz;
     int npages = (PGROUNDUP(oldsz) - PGROUNDUP(newsz)) / PGSIZE;
     uvmunmap(pagetable, PGROUNDUP(newsz), npages, 1);
   }
@@ -289,59 +741,157 @@ uvmfree(pagetable_t pagetable, uint64 sz)
 
 // Given a parent process's page table, copy
 // its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Copies the page table, but shares the physical
+// memory: writable pages become read-only and
+// copy-on-write in both parent and child, and
+// are copied on the first write by uvmcow().
+// Superpages are shared whole.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
 uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+{
+  return uvmshare(old, new, 0, sz, 1);
+}
+
+// Map the pages that old maps in [start, end) into new,
+// sharing the physical memory. If cow, writable pages
+// become copy-on-write in both; otherwise old and new
+// share them writably, as for MAP_SHARED.
+// returns 0 on success, -1 on failure, after removing
+// the mappings it added to new.
+int
+uvmshare(pagetable_t old, pagetable_t new, uint64 start, uint64 end, int cow)
 {
   pte_t *pte;
   uint64 pa, i;
   uint flags;
-  char *mem;
 
-  for(i = 0; i < sz; i += PGSIZE){
+  for(i = start; i < end; i += PGSIZE){
+    if((pte = superpte(old, i)) != 0){
+      if(cow && i % SUPERPGSIZE == 0 && i + SUPERPGSIZE <= end){
+        // share the whole 2MB block copy-on-write.
+        pte_t *npte;
+        if((npte = walklevel(new, i, 1, 1)) == 0 || *npte != 0)
+          goto err;
+        if(*pte & PTE_W){
+          *pte = (*pte & ~PTE_W) | PTE_COW;
+          uvmflush(old, i);
+        }
+        kref((void*)PTE2PA(*pte));
+        *npte = *pte;
+        i += SUPERPGSIZE - PGSIZE;
+        continue;
+      }
+      // share the memory as 4KB pages, after making it
+      // old's own so that it can be split.
+      pagetable_t pt;
+      if(superown(old, i, pte) < 0)
+        goto err;
+      if((pte = superpte(old, i)) != 0){
+        if((pt = (pagetable_t)kzalloc()) == 0)
+          goto err;
+        demote(pte, pt);
+        uvmflush(old, i);
+      }
+    }
     if((pte = walk(old, i, 0)) == 0)
       continue;   // page table entry hasn't been allocated
     if((*pte & PTE_V) == 0)
       continue;   // physical page hasn't been allocated
+    if(cow && (*pte & PTE_W)){
+      *pte = (*pte & ~PTE_W) | PTE_COW;
+      uvmflush(old, i);
+    }
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
+    kref((void*)pa);
+    if(mappages(new, i, PGSIZE, pa, flags) != 0){
+      kfree((void*)pa);
       goto err;
     }
   }
+  // other threads of old must not write to pages that
+  // are now copy-on-write.
+  if(cow)
+    tlbshootdown(old);
   return 0;
 
  err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
+  if(cow)
+    tlbshootdown(old);
+  uvmunmap(new, start, (i - start) / PGSIZE, 1);
   return -1;
 }
 
+// Give pagetable a private, writable copy of the
+// copy-on-write page at va. If no one else refers to
+// the physical page any more, just make it writable.
+// A copy-on-write superpage is copied whole if it can be.
+// Returns the physical address of the page, or 0 if
+// va is not a copy-on-write page or out of memory.
+uint64
+uvmcow(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  uint flags;
+  char *mem;
+
+  if((pte = superpte(pagetable, va)) != 0){
+    if(*pte & PTE_W)
+      return walkaddr(pagetable, va);  // another thread copied it
+    if((*pte & PTE_COW) == 0 || superown(pagetable, va, pte) < 0)
+      return 0;
+    return walkaddr(pagetable, va);
+  }
+  if((pte = walk(pagetable, va, 0)) == 0 || (*pte & PTE_V) == 0)
+    return 0;
+  if((*pte & (PTE_W|PTE_U)) == (PTE_W|PTE_U))
+    return PTE2PA(*pte);  // another thread copied it
+  if((*pte & PTE_COW) == 0)
+    return 0;
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+  if(krefcount((void*)pa) == 1){
+    *pte = PA2PTE(pa) | flags;
+    uvmflush(pagetable, va);
+    return pa;
+  }
+  if((mem = kalloc()) == 0)
+    return 0;
+  memmove(mem, (char*)pa, PGSIZE);
+  *pte = PA2PTE(mem) | flags;
+  uvmflush(pagetable, va);
+  tlbshootdown(pagetable);
+  kfree((void*)pa);
+  return (uint64)mem;
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
 uvmclear(pagetable_t pagetable, uint64 va)
 {
   pte_t *pte;
+  pagetable_t pt;
   
+  if((pte = superpte(pagetable, va)) != 0){
+    if((pt = (pagetable_t)kzalloc()) == 0)
+      panic("uvmclear");
+    demote(pte, pt);
+  }
   pte = walk(pagetable, va, 0);
   if(pte == 0)
     panic("uvmclear");
   *pte &= ~PTE_U;
+  uvmflush(pagetable, va);
 }
 
-// Copy from kernel to user.
-// Copy len bytes from src to virtual address dstva in a given page table.
-// Return 0 on success, -1 on error.
-int
-copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
+static int
+ucopyout(struct mm *mm, pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
+  struct ucache c = { pagetable, 0, 0 };
   uint64 n, va0, pa0;
   pte_t *pte;
 
@@ -350,17 +900,21 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
     if(va0 >= MAXVA)
       return -1;
   
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0) {
-      if((pa0 = vmfault(pagetable, va0, 0)) == 0) {
+    if((pa0 = ulookup(&c, va0, &pte)) == 0){
+      if(copyfault(mm, pagetable, va0, 0) == 0 || (pa0 = ulookup(&c, va0, &pte)) == 0)
         return -1;
-      }
     }
 
-    pte = walk(pagetable, va0, 0);
+    // uvmcow() may split a superpage, so look va0 up again.
+    if((*pte & PTE_COW) &&
+       (uvmcow(pagetable, va0) == 0 || (pa0 = ulookup(&c, va0, &pte)) == 0))
+      return -1;
     // forbid copyout over read-only user text pages.
     if((*pte & PTE_W) == 0)
       return -1;
+    // a MAP_SHARED page written by the kernel must be
+    // written back to its file, as if the user wrote it.
+    *pte |= PTE_D;
       
     n = PGSIZE - (dstva - va0);
     if(n > len)
@@ -374,19 +928,30 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
   return 0;
 }
 
-// Copy from user to kernel.
-// Copy len bytes to dst from virtual address srcva in a given page table.
+// Copy from kernel to user.
+// Copy len bytes from src to virtual address dstva in a given page table.
 // Return 0 on success, -1 on error.
 int
-copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
+copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
+  struct mm *mm = copylock(pagetable);
+  int r = ucopyout(mm, pagetable, dstva, src, len);
+
+  copyunlock(mm);
+  return r;
+}
+
+static int
+ucopyin(struct mm *mm, pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
+{
+  struct ucache c = { pagetable, 0, 0 };
   uint64 n, va0, pa0;
 
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = ulookup(&c, va0, 0);
     if(pa0 == 0) {
-      if((pa0 = vmfault(pagetable, va0, 0)) == 0) {
+      if((pa0 = copyfault(mm, pagetable, va0, 1)) == 0) {
         return -1;
       }
     }
@@ -402,27 +967,52 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
   return 0;
 }
 
-// Copy a null-terminated string from user to kernel.
-// Copy bytes to dst from virtual address srcva in a given page table,
-// until a '\0', or max.
+// Copy from user to kernel.
+// Copy len bytes to dst from virtual address srcva in a given page table.
 // Return 0 on success, -1 on error.
 int
-copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
+copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 {
+  struct mm *mm = copylock(pagetable);
+  int r = ucopyin(mm, pagetable, dst, srcva, len);
+
+  copyunlock(mm);
+  return r;
+}
+
+static int
+ucopyinstr(struct mm *mm, pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
+{
+  struct ucache c = { pagetable, 0, 0 };
   uint64 n, va0, pa0;
   int got_null = 0;
 
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
-      return -1;
+    pa0 = ulookup(&c, va0, 0);
+    if(pa0 == 0) {
+      if((pa0 = copyfault(mm, pagetable, va0, 1)) == 0) {
+        return -1;
+      }
+    }
     n = PGSIZE - (srcva - va0);
     if(n > max)
       n = max;
 
     char *p = (char *) (pa0 + (srcva - va0));
     while(n > 0){
+      // a word at a time while no byte of the word is zero.
+      if((uint64)p % 8 == 0 && n >= 8 && !HASZERO(*(uint64*)p)){
+        if((uint64)dst % 8 == 0)
+          *(uint64*)dst = *(uint64*)p;
+        else
+          memmove(dst, p, 8);
+        n -= 8;
+        max -= 8;
+        p += 8;
+        dst += 8;
+        continue;
+      }
       if(*p == '\0'){
         *dst = '\0';
         got_null = 1;
@@ -445,33 +1035,101 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
   }
 }
 
-// allocate and map user memory if process is referencing a page
-// that was lazily allocated in sys_sbrk().
-// returns 0 if va is invalid or already mapped, or if
-// out of physical memory, and physical address if successful.
-uint64
-vmfault(pagetable_t pagetable, uint64 va, int read)
+// Copy a null-terminated string from user to kernel.
+// Copy bytes to dst from virtual address srcva in a given page table,
+// until a '\0', or max.
+// Return 0 on success, -1 on error.
+int
+copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 {
-  uint64 mem;
+  struct mm *mm = copylock(pagetable);
+  int r = ucopyinstr(mm, pagetable, dst, srcva, max);
+
+  copyunlock(mm);
+  return r;
+}
+
+// vmfault() with p->mm->lock held, so that no other thread
+// changes the address space.
+static uint64
+fault(pagetable_t pagetable, uint64 va, int read)
+{
+  uint64 mem, a, pa;
   struct proc *p = myproc();
 
-  if (va >= p->sz)
-    return 0;
+  if (va >= p->mm->sz || vmalookup(p, va))
+    return mmapfault(pagetable, va, read);
   va = PGROUNDDOWN(va);
   if(ismapped(pagetable, va)) {
+    if(read == 0)
+      return uvmcow(pagetable, va);
     return 0;
   }
-  mem = (uint64) kalloc();
-  if(mem == 0)
-    return 0;
-  memset((void *) mem, 0, PGSIZE);
-  if (mappages(p->pagetable, va, PGSIZE, mem, PTE_W|PTE_U|PTE_R) != 0) {
-    kfree((void *)mem);
-    return 0;
+  p->nfault++;
+
+  // the first touch of an empty 2MB-aligned region,
+  // as when a large heap is filled sequentially, maps
+  // the whole region with a superpage if it can.
+  if(va % SUPERPGSIZE == 0 && va + SUPERPGSIZE <= p->mm->sz &&
+     (mem = superalloc(pagetable, va, PTE_W|PTE_U|PTE_R)) != 0){
+    p->nfaultpg += SUPERPGSIZE / PGSIZE;
+    p->faultnext = 0;
+    return mem;
   }
+
+  // fault around: map a window of pages starting at va,
+  // doubling it up to FAULTAROUND pages while each fault
+  // lands just after the previous window. stop at mapped
+  // pages and at 2MB boundaries, which might get superpages.
+  if(va == p->faultnext && p->faultwin > 0)
+    p->faultwin = p->faultwin*2 > FAULTAROUND ? FAULTAROUND : p->faultwin*2;
+  else
+    p->faultwin = 1;
+  mem = 0;
+  for(a = va; a < va + p->faultwin*PGSIZE && a < p->mm->sz; a += PGSIZE){
+    if(a != va && (a % SUPERPGSIZE == 0 || ismapped(pagetable, a)))
+      break;
+    if((pa = (uint64) kzalloc()) == 0)
+      break;
+    if (mappages(pagetable, a, PGSIZE, pa, PTE_W|PTE_U|PTE_R) != 0) {
+      kfree((void *)pa);
+      break;
+    }
+    if(a == va)
+      mem = pa;
+    p->nfaultpg++;
+  }
+  p->faultnext = a;
   return mem;
 }
 
+// allocate and map user memory if process is referencing a page
+// that was lazily allocated in sys_sbrk() or lies in an mmap()ed
+// region or program segment, or copy a copy-on-write page that
+// the process is writing.
+// returns 0 if va is invalid or already mapped, or if
+// out of physical memory, and physical address if successful.
+uint64
+vmfault(pagetable_t pagetable, uint64 va, int read)
+{
+  struct proc *p = myproc();
+  uint64 pa;
+  int noff;
+
+  // faults wait for p->mm->lock, so nothing may copy to or
+  // from user memory while holding a spinlock.
+  push_off();
+  noff = mycpu()->noff;
+  pop_off();
+  if(noff > 1)
+    panic("vmfault: spinlock held");
+
+  acquiresleep(&p->mm->lock);
+  pa = fault(pagetable, va, read);
+  releasesleep(&p->mm->lock);
+  return pa;
+}
+
 int
 ismapped(pagetable_t pagetable, uint64 va)
 {
@@ -484,3 +1142,40 @@ ismapped(pagetable_t pagetable, uint64 va)
   }
   return 0;
 }
+
+// Count pagetable's page-table pages in *ntable and its
+// leaf PTEs at each level in nleaf[].
+static void
+vmcount(pagetable_t pagetable, int level, int *ntable, int *nleaf)
+{
+  (*ntable)++;
+  for(int i = 0; i < 512; i++){
+    pte_t pte = pagetable[i];
+    if((pte & PTE_V) == 0)
+      continue;
+    if(PTE_LEAF(pte) || level == 0)
+      nleaf[level]++;
+    else
+      vmcount((pagetable_t)PTE2PA(pte), level-1, ntable, nleaf);
+  }
+}
+
+// Print the size of a page table and how many 1GB, 2MB
+// and 4KB leaves it has.
+void
+vmprint(char *name, pagetable_t pagetable)
+{
+  int ntable = 0, nleaf[3] = { 0, 0, 0 };
+
+  vmcount(pagetable, 2, &ntable, nleaf);
+  printf("%s page table: %d pages, leaves 1G %d 2M %d 4K %d\n",
+         name, ntable, nleaf[2], nleaf[1], nleaf[0]);
+}
+
+// Print a summary of the kernel page table.
+// For debugging; runs from procdump() without locks.
+void
+kvmdump(void)
+{
+  vmprint("kernel", kernel_pagetable);
+}
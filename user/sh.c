@@ -3,6 +3,7 @@
 #include "kernel/types.h"
 #include "user/user.h"
 #include "kernel/fcntl.h"
+#include "kernel/spawn.h"
 
 // Parsed command representation
 #define EXEC  1
@@ -52,6 +53,7 @@ struct backcmd {
 int fork1(void);  // Fork but panics on failure.
 void panic(char*);
 struct cmd *parsecmd(char*);
+void freecmd(struct cmd*);
 void runcmd(struct cmd*) __attribute__((noreturn));
 
 // Execute cmd.  Never returns.
@@ -147,6 +149,103 @@ runcmd(struct cmd *cmd)
   exit(0);
 }
 
+// Can cmd run without forking the shell? That is, is it
+// a pipeline of commands with only file redirections?
+int
+spawnable(struct cmd *cmd)
+{
+  struct pipecmd *pcmd;
+  struct redircmd *rcmd;
+
+  switch(cmd->type){
+  case EXEC:
+    return ((struct execcmd*)cmd)->argv[0] != 0;
+  case REDIR:
+    rcmd = (struct redircmd*)cmd;
+    return rcmd->cmd->type != PIPE && spawnable(rcmd->cmd);
+  case PIPE:
+    pcmd = (struct pipecmd*)cmd;
+    return pcmd->left->type != PIPE && spawnable(pcmd->left) &&
+      spawnable(pcmd->right);
+  }
+  return 0;
+}
+
+// Start one pipeline stage in a child, with the file
+// actions a[0..n-1] connecting it to its neighbours.
+// Falls back to fork() if spawn() fails, so that the
+// child reports the error as runcmd() would.
+void
+spawnstage(struct cmd *cmd, struct spawn_action *a, int n)
+{
+  struct spawn_action *p;
+  struct redircmd *rcmd;
+  struct execcmd *ecmd;
+  struct cmd *stage;
+  int i;
+
+  stage = cmd;
+  i = n;
+  for(; cmd->type == REDIR && i < NSPAWNACT; cmd = rcmd->cmd){
+    rcmd = (struct redircmd*)cmd;
+    a[i++] = (struct spawn_action){SPAWN_OPEN, rcmd->fd, 0, rcmd->mode, rcmd->file};
+  }
+  ecmd = (struct execcmd*)cmd;
+  if(cmd->type == EXEC){
+    if(spawn(ecmd->argv[0], ecmd->argv, a, i) >= 0)
+      return;
+  }
+
+  if(fork1() == 0){
+    for(p = a; p < a + n; p++){
+      if(p->type == SPAWN_DUP2){
+        close(p->fd);
+        dup(p->srcfd);
+      } else {
+        close(p->fd);
+      }
+    }
+    runcmd(stage);
+  }
+}
+
+// Start the stages of pipeline cmd, which must be spawnable().
+// Returns the number of children to wait for.
+int
+spawnpipe(struct cmd *cmd)
+{
+  struct spawn_action a[NSPAWNACT];
+  struct pipecmd *pcmd;
+  int n, nchild, in, p[2];
+
+  in = -1;
+  for(nchild = 1; ; nchild++){
+    n = 0;
+    if(in >= 0){
+      a[n++] = (struct spawn_action){SPAWN_DUP2, 0, in};
+      a[n++] = (struct spawn_action){SPAWN_CLOSE, in};
+    }
+    if(cmd->type != PIPE){
+      spawnstage(cmd, a, n);
+      if(in >= 0)
+        close(in);
+      return nchild;
+    }
+    pcmd = (struct pipecmd*)cmd;
+    if(pipe(p) < 0)
+      panic("pipe");
+    a[n++] = (struct spawn_action){SPAWN_DUP2, 1, p[1]};
+    a[n++] = (struct spawn_action){SPAWN_CLOSE, p[0]};
+    a[n++] = (struct spawn_action){SPAWN_CLOSE, p[1]};
+    spawnstage(pcmd->left, a, n);
+    if(in >= 0)
+      close(in);
+    close(p[1]);
+    in = p[0];
+    cmd = pcmd->right;
+  }
+}
+
 int
 getcmd(char *buf, int nbuf)
 {
@@ -162,7 +261,8 @@ int
 main(void)
 {
   static char buf[100];
-  int fd;
+  int fd, n;
+  struct cmd *c;
 
   // Ensure that three file descriptors are open.
   while((fd = open("console", O_RDWR)) >= 0){
@@ -184,10 +284,17 @@ main(void)
       cmd[strlen(cmd)-1] = 0;  // chop \n
       if(chdir(cmd+3) < 0)
         fprintf(2, "cannot cd %s\n", cmd+3);
-    } else {
-      if(fork1() == 0)
-        runcmd(parsecmd(cmd));
-      wait(0);
+    } else if((c = parsecmd(cmd)) != 0){
+      if(spawnable(c)){
+        // Commands and pipelines need not copy the shell.
+        for(n = spawnpipe(c); n > 0; n--)
+          wait(0);
+      } else {
+        if(fork1() == 0)
+          runcmd(c);
+        wait(0);
+      }
+      freecmd(c);
     }
   }
   exit(0);
@@ -341,6 +448,16 @@ peek(char **ps, char *es, char *toks)
   return *s && strchr(toks, *s);
 }
 
+int parseerr;  // set by syntax(); the shell parses in-process
+
+void
+syntax(char *msg)
+{
+  if(!parseerr)
+    fprintf(2, "%s\n", msg);
+  parseerr = 1;
+}
+
 struct cmd *parseline(char**, char*);
 struct cmd *parsepipe(char**, char*);
 struct cmd *parseexec(char**, char*);
@@ -352,12 +469,17 @@ parsecmd(char *s)
   char *es;
   struct cmd *cmd;
 
+  parseerr = 0;
   es = s + strlen(s);
   cmd = parseline(&s, es);
   peek(&s, es, "");
-  if(s != es){
+  if(s != es && !parseerr){
     fprintf(2, "leftovers: %s\n", s);
-    panic("syntax");
+    syntax("syntax");
+  }
+  if(parseerr){
+    freecmd(cmd);
+    return 0;
   }
   nulterminate(cmd);
   return cmd;
@@ -401,8 +523,10 @@ parseredirs(struct cmd *cmd, char **ps, char *es)
 
   while(peek(ps, es, "<>")){
     tok = gettoken(ps, es, 0, 0);
-    if(gettoken(ps, es, &q, &eq) != 'a')
-      panic("missing file for redirection");
+    if(gettoken(ps, es, &q, &eq) != 'a'){
+      syntax("missing file for redirection");
+      break;
+    }
     switch(tok){
     case '<':
       cmd = redircmd(cmd, q, eq, O_RDONLY, 0);
@@ -427,8 +551,10 @@ parseblock(char **ps, char *es)
     panic("parseblock");
   gettoken(ps, es, 0, 0);
   cmd = parseline(ps, es);
-  if(!peek(ps, es, ")"))
-    panic("syntax - missing )");
+  if(!peek(ps, es, ")")){
+    syntax("syntax - missing )");
+    return cmd;
+  }
   gettoken(ps, es, 0, 0);
   cmd = parseredirs(cmd, ps, es);
   return cmd;
@@ -453,13 +579,17 @@ parseexec(char **ps, char *es)
   while(!peek(ps, es, "|)&;")){
     if((tok=gettoken(ps, es, &q, &eq)) == 0)
       break;
-    if(tok != 'a')
-      panic("syntax");
+    if(tok != 'a'){
+      syntax("syntax");
+      break;
+    }
+    if(argc >= MAXARGS-1){
+      syntax("too many args");
+      break;
+    }
     cmd->argv[argc] = q;
     cmd->eargv[argc] = eq;
     argc++;
-    if(argc >= MAXARGS)
-      panic("too many args");
     ret = parseredirs(ret, ps, es);
   }
   cmd->argv[argc] = 0;
@@ -513,3 +643,41 @@ nulterminate(struct cmd *cmd)
   }
   return cmd;
 }
+
+// Free the nodes of a parsed command.
+void
+freecmd(struct cmd *cmd)
+{
+  struct backcmd *bcmd;
+  struct listcmd *lcmd;
+  struct pipecmd *pcmd;
+  struct redircmd *rcmd;
+
+  if(cmd == 0)
+    return;
+
+  switch(cmd->type){
+  case REDIR:
+    rcmd = (struct redircmd*)cmd;
+    freecmd(rcmd->cmd);
+    break;
+
+  case PIPE:
+    pcmd = (struct pipecmd*)cmd;
+    freecmd(pcmd->left);
+    freecmd(pcmd->right);
+    break;
+
+  case LIST:
+    lcmd = (struct listcmd*)cmd;
+    freecmd(lcmd->left);
+    freecmd(lcmd->right);
+    break;
+
+  case BACK:
+    bcmd = (struct backcmd*)cmd;
+    freecmd(bcmd->cmd);
+    break;
+  }
+  free(cmd);
+}
@@ -0,0 +1,172 @@
+// Threads, which share their creator's memory, and locks
+// for them to coordinate with: spin locks, and mutexes and
+// condition variables that sleep in futex() when contended.
+
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+#define STACKSIZE 4096
+
+struct start {
+  void (*fn)(void*);
+  void *arg;
+};
+
+// stacks of threads not yet joined, to free at join.
+static struct {
+  int tid;
+  void *stack;
+} threads[NTHREAD];
+static lock_t tlock;
+
+void
+lock_init(lock_t *lk)
+{
+  lk->locked = 0;
+}
+
+void
+lock_acquire(lock_t *lk)
+{
+  while(__sync_lock_test_and_set(&lk->locked, 1) != 0)
+    ;
+  __sync_synchronize();
+}
+
+void
+lock_release(lock_t *lk)
+{
+  __sync_synchronize();
+  __sync_lock_release(&lk->locked);
+}
+
+void
+mutex_init(mutex_t *m)
+{
+  m->state = 0;
+}
+
+// An uncontended lock or unlock is one atomic instruction;
+// only a thread that finds the mutex held enters the kernel,
+// and marks it contended so that the unlocker wakes it.
+void
+mutex_lock(mutex_t *m)
+{
+  uint c;
+
+  if((c = __sync_val_compare_and_swap(&m->state, 0, 1)) == 0)
+    return;
+  if(c != 2)
+    c = __sync_lock_test_and_set(&m->state, 2);
+  while(c != 0){
+    futex(&m->state, FUTEX_WAIT, 2);
+    c = __sync_lock_test_and_set(&m->state, 2);
+  }
+}
+
+void
+mutex_unlock(mutex_t *m)
+{
+  if(__sync_fetch_and_sub(&m->state, 1) != 1){
+    __sync_lock_release(&m->state);
+    futex(&m->state, FUTEX_WAKE, 1);
+  }
+}
+
+void
+cond_init(cond_t *c)
+{
+  c->seq = 0;
+}
+
+// Release m, sleep until signalled, and reacquire m.
+// May return without a signal, so callers must recheck
+// their condition.
+void
+cond_wait(cond_t *c, mutex_t *m)
+{
+  uint seq = c->seq;
+
+  mutex_unlock(m);
+  futex(&c->seq, FUTEX_WAIT, seq);
+  // there may be other waiters woken by a broadcast,
+  // so take m as contended.
+  while(__sync_lock_test_and_set(&m->state, 2) != 0)
+    futex(&m->state, FUTEX_WAIT, 2);
+}
+
+void
+cond_signal(cond_t *c)
+{
+  __sync_fetch_and_add(&c->seq, 1);
+  futex(&c->seq, FUTEX_WAKE, 1);
+}
+
+void
+cond_broadcast(cond_t *c)
+{
+  __sync_fetch_and_add(&c->seq, 1);
+  futex(&c->seq, FUTEX_WAKE, 0x7fffffff);
+}
+
+static void
+tstart(void *a)
+{
+  struct start *s = a;
+
+  s->fn(s->arg);
+  texit(0);
+}
+
+// Start a thread running fn(arg) on a stack of its own.
+// Returns its thread id, or -1.
+int
+thread_create(void (*fn)(void*), void *arg)
+{
+  char *stack;
+  struct start *s;
+  int i, tid;
+
+  if((stack = malloc(STACKSIZE)) == 0)
+    return -1;
+  s = (struct start*)(stack + STACKSIZE) - 1;
+  s->fn = fn;
+  s->arg = arg;
+
+  lock_acquire(&tlock);
+  for(i = 0; i < NTHREAD; i++)
+    if(threads[i].stack == 0)
+      break;
+  if(i == NTHREAD || (tid = clone(tstart, s, s)) < 0){
+    lock_release(&tlock);
+    free(stack);
+    return -1;
+  }
+  threads[i].tid = tid;
+  threads[i].stack = stack;
+  lock_release(&tlock);
+  return tid;
+}
+
+// Wait for thread tid to exit, and free its stack.
+// Returns tid, or -1.
+int
+thread_join(int tid, int *status)
+{
+  int i;
+
+  if(join(tid, status) < 0)
+    return -1;
+  lock_acquire(&tlock);
+  for(i = 0; i < NTHREAD; i++){
+    if(threads[i].stack && threads[i].tid == tid){
+      free(threads[i].stack);
+      threads[i].stack = 0;
+      break;
+    }
+  }
+  lock_release(&tlock);
+  return tid;
+}
@@ -45,14 +45,33 @@ strlen(const char *s)
   return n;
 }
 
+// memset() and memmove() align to 8 bytes, then move 64
+// bytes per iteration, then words, then the tail in bytes;
+// see kernel/string.c.
 void*
 memset(void *dst, int c, uint n)
 {
   char *cdst = (char *) dst;
-  int i;
-  for(i = 0; i < n; i++){
-    cdst[i] = c;
+  uint64 *wdst, w;
+
+  for(; n > 0 && (uint64)cdst % 8 != 0; n--)
+    *cdst++ = c;
+  if(n >= 8){
+    w = (uchar)c;
+    w |= w << 8;
+    w |= w << 16;
+    w |= w << 32;
+    wdst = (uint64 *) cdst;
+    for(; n >= 64; n -= 64, wdst += 8){
+      wdst[0] = w; wdst[1] = w; wdst[2] = w; wdst[3] = w;
+      wdst[4] = w; wdst[5] = w; wdst[6] = w; wdst[7] = w;
+    }
+    for(; n >= 8; n -= 8)
+      *wdst++ = w;
+    cdst = (char *) wdst;
   }
+  for(; n > 0; n--)
+    *cdst++ = c;
   return dst;
 }
 
@@ -113,15 +132,54 @@ memmove(void *vdst, const void *vsrc, int n)
 {
   char *dst;
   const char *src;
+  int words;
 
   dst = vdst;
   src = vsrc;
+  words = ((uint64)src ^ (uint64)dst) % 8 == 0;
   if (src > dst) {
+    if(words){
+      for(; n > 0 && (uint64)dst % 8 != 0; n--)
+        *dst++ = *src++;
+      for(; n >= 64; n -= 64, dst += 64, src += 64){
+        ((uint64*)dst)[0] = ((uint64*)src)[0];
+        ((uint64*)dst)[1] = ((uint64*)src)[1];
+        ((uint64*)dst)[2] = ((uint64*)src)[2];
+        ((uint64*)dst)[3] = ((uint64*)src)[3];
+        ((uint64*)dst)[4] = ((uint64*)src)[4];
+        ((uint64*)dst)[5] = ((uint64*)src)[5];
+        ((uint64*)dst)[6] = ((uint64*)src)[6];
+        ((uint64*)dst)[7] = ((uint64*)src)[7];
+      }
+      for(; n >= 8; n -= 8, dst += 8, src += 8)
+        *(uint64*)dst = *(uint64*)src;
+    }
     while(n-- > 0)
       *dst++ = *src++;
   } else {
     dst += n;
     src += n;
+    if(words){
+      for(; n > 0 && (uint64)dst % 8 != 0; n--)
+        *--dst = *--src;
+      for(; n >= 64; n -= 64){
+        dst -= 64;
+        src -= 64;
+        ((uint64*)dst)[7] = ((uint64*)src)[7];
+        ((uint64*)dst)[6] = ((uint64*)src)[6];
+        ((uint64*)dst)[5] = ((uint64*)src)[5];
+        ((uint64*)dst)[4] = ((uint64*)src)[4];
+        ((uint64*)dst)[3] = ((uint64*)src)[3];
+        ((uint64*)dst)[2] = ((uint64*)src)[2];
+        ((uint64*)dst)[1] = ((uint64*)src)[1];
+        ((uint64*)dst)[0] = ((uint64*)src)[0];
+      }
+      for(; n >= 8; n -= 8){
+        dst -= 8;
+        src -= 8;
+        *(uint64*)dst = *(uint64*)src;
+      }
+    }
     while(n-- > 0)
       *--dst = *--src;
   }
@@ -1,6 +1,19 @@
 #define SBRK_ERROR ((char *)-1)
 
 struct stat;
+struct spawn_action;
+
+typedef struct {
+  volatile uint locked;
+} lock_t;
+
+typedef struct {
+  volatile uint state;  // 0 unlocked, 1 locked, 2 locked and contended
+} mutex_t;
+
+typedef struct {
+  volatile uint seq;    // bumped by each signal or broadcast
+} cond_t;
 
 // system calls
 int fork(void);
@@ -12,6 +25,7 @@ int read(int, void*, int);
 int close(int);
 int kill(int);
 int exec(const char*, char**);
+int spawn(const char*, char**, struct spawn_action*, int);
 int open(const char*, int);
 int mknod(const char*, short, short);
 int unlink(const char*);
@@ -24,6 +38,17 @@ int getpid(void);
 char* sys_sbrk(int,int);
 int pause(int);
 int uptime(void);
+void* mmap(void*, uint64, int, int, int, uint64);
+int munmap(void*, uint64);
+int nanosleep(uint64);
+int nice(int);
+int sched_setaffinity(int, uint64);
+int sched_getaffinity(int, uint64*);
+int clone(void(*)(void*), void*, void*);
+int join(int, int*);
+int futex(volatile uint*, int, int);
+int texit(int) __attribute__((noreturn));
+int nmigrate(int);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -47,3 +72,17 @@ void printf(const char*, ...) __attribute__ ((format (printf, 1, 2)));
 // umalloc.c
 void* malloc(uint);
 void free(void*);
+
+// thread.c
+void lock_init(lock_t*);
+void lock_acquire(lock_t*);
+void lock_release(lock_t*);
+int thread_create(void(*)(void*), void*);
+int thread_join(int, int*);
+void mutex_init(mutex_t*);
+void mutex_lock(mutex_t*);
+void mutex_unlock(mutex_t*);
+void cond_init(cond_t*);
+void cond_wait(cond_t*, mutex_t*);
+void cond_signal(cond_t*);
+void cond_broadcast(cond_t*);
@@ -4,6 +4,7 @@
 #include "user/user.h"
 #include "kernel/fs.h"
 #include "kernel/fcntl.h"
+#include "kernel/spawn.h"
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
@@ -733,6 +734,231 @@ exectest(char *s)
 
 }
 
+// spawn() with file actions, and spawn() of a missing program.
+void
+spawntest(char *s)
+{
+  int fd, xstatus, pid;
+  char *echoargv[] = { "echo", "OK", 0 };
+  char buf[3];
+  struct spawn_action a[] = {
+    { SPAWN_OPEN, 1, 0, O_CREATE|O_WRONLY, "spawn-ok" },
+    { SPAWN_DUP2, 2, 1 },
+  };
+
+  unlink("spawn-ok");
+  if(spawn("nonexistent", echoargv, a, 2) >= 0){
+    printf("%s: spawn nonexistent succeeded\n", s);
+    exit(1);
+  }
+  if((pid = spawn("echo", echoargv, a, 2)) < 0){
+    printf("%s: spawn echo failed\n", s);
+    exit(1);
+  }
+  if(wait(&xstatus) != pid || xstatus != 0){
+    printf("%s: wait failed\n", s);
+    exit(1);
+  }
+  fd = open("spawn-ok", O_RDONLY);
+  if(fd < 0 || read(fd, buf, 2) != 2){
+    printf("%s: no output\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("spawn-ok");
+  if(buf[0] != 'O' || buf[1] != 'K'){
+    printf("%s: wrong output\n", s);
+    exit(1);
+  }
+}
+
+// mmap() a file MAP_SHARED and MAP_PRIVATE, write through
+// the mappings, and check what reaches the file. fork()
+// shares the MAP_SHARED pages with the child, and two
+// MAP_SHARED mappings of a file share its pages.
+void
+mmaptest(char *s)
+{
+  int fd, pid, xstatus, n;
+  char *p, *q, *r;
+  struct stat st;
+
+  unlink("mmap-file");
+  fd = open("mmap-file", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  memset(buf, 'x', PGSIZE+100);
+  if(write(fd, buf, PGSIZE+100) != PGSIZE+100){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+
+  p = mmap(0, 2*PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(p == (char*)-1){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  if(p[0] != 'x' || p[PGSIZE+99] != 'x' || p[PGSIZE+100] != 0){
+    printf("%s: wrong contents\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    p[1] = 'y';
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0 || p[1] != 'y'){
+    printf("%s: MAP_SHARED page not shared with child\n", s);
+    exit(1);
+  }
+
+  q = mmap(0, PGSIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(q == (char*)-1 || q[1] != 'y'){
+    printf("%s: MAP_PRIVATE mmap failed\n", s);
+    exit(1);
+  }
+  q[2] = 'z';
+  if(munmap(q, PGSIZE) != 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+
+  p[0] = 'w';
+  r = mmap(0, PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(r == (char*)-1 || r[0] != 'w'){
+    printf("%s: MAP_SHARED mappings don't share pages\n", s);
+    exit(1);
+  }
+  r[2] = 'v';
+  if(p[2] != 'v' || munmap(r, PGSIZE) != 0){
+    printf("%s: MAP_SHARED mappings don't share pages\n", s);
+    exit(1);
+  }
+  if(munmap(p, 2*PGSIZE) != 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("mmap-file", O_RDONLY);
+  if(fd < 0 || fstat(fd, &st) < 0 || st.size != PGSIZE+100){
+    printf("%s: file size changed\n", s);
+    exit(1);
+  }
+  n = read(fd, buf, 3);
+  if(n != 3 || buf[0] != 'w' || buf[1] != 'y' || buf[2] != 'v'){
+    printf("%s: wrong file contents\n", s);
+    exit(1);
+  }
+  if(mmap(0, PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0) != (char*)-1){
+    printf("%s: writable MAP_SHARED of read-only fd\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("mmap-file");
+}
+
+// MAP_SHARED|MAP_ANONYMOUS memory is shared with children,
+// even pages that no one touched before the fork();
+// MAP_PRIVATE|MAP_ANONYMOUS memory is not.
+void
+shmtest(char *s)
+{
+  char *sh, *pv;
+  int pid, xstatus;
+
+  sh = mmap(0, 3*PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  pv = mmap(0, PGSIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(sh == (char*)-1 || pv == (char*)-1){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  sh[0] = 1;
+  pv[0] = 1;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(sh[0] != 1 || sh[2*PGSIZE] != 0 || pv[0] != 1)
+      exit(1);
+    sh[0] = 2;
+    sh[2*PGSIZE] = 3;
+    pv[0] = 4;
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child saw wrong contents\n", s);
+    exit(1);
+  }
+  if(sh[0] != 2 || sh[2*PGSIZE] != 3){
+    printf("%s: shared memory not shared\n", s);
+    exit(1);
+  }
+  if(pv[0] != 1){
+    printf("%s: private memory shared\n", s);
+    exit(1);
+  }
+
+  // unmap the middle page, splitting the region.
+  if(munmap(sh + PGSIZE, PGSIZE) != 0 || sh[2*PGSIZE] != 3){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+  if(munmap(sh, 3*PGSIZE) != 0 || munmap(pv, PGSIZE) != 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+}
+
+// exec() maps a program's segments lazily: data must
+// arrive initialized, .bss zeroed, and text read-only.
+static char lazybss[4*4096];
+static int lazydata[2] = { 0x1234, 0x5678 };
+
+void
+lazyexec(char *s)
+{
+  int i, pid, xstatus;
+
+  if(lazydata[0] != 0x1234 || lazydata[1] != 0x5678){
+    printf("%s: wrong initialized data\n", s);
+    exit(1);
+  }
+  for(i = 0; i < sizeof(lazybss); i++){
+    if(lazybss[i] != 0){
+      printf("%s: bss not zero\n", s);
+      exit(1);
+    }
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    *(volatile char*)lazyexec = 0;
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != -1){
+    printf("%s: wrote to program text\n", s);
+    exit(1);
+  }
+}
+
 // simple fork and pipe read/write
 
 void
@@ -818,6 +1044,331 @@ killstatus(char *s)
   exit(0);
 }
 
+// nanosleep() sleeps for less than a tick; a sleeping
+// child can be killed long before its deadline.
+void
+sleeptest(char *s)
+{
+  int i, t0, pid, xst;
+
+  t0 = uptime();
+  for(i = 0; i < 10; i++){
+    if(nanosleep(1000000) != 0){
+      printf("%s: nanosleep failed\n", s);
+      exit(1);
+    }
+  }
+  if(uptime() - t0 > 5){
+    printf("%s: ten 1ms nanosleeps took %d ticks\n", s, uptime() - t0);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    pause(100000);
+    exit(0);
+  }
+  pause(1);
+  t0 = uptime();
+  kill(pid);
+  wait(&xst);
+  if(xst != -1 || uptime() - t0 > 10){
+    printf("%s: killed sleeper status %d\n", s, xst);
+    exit(1);
+  }
+}
+
+// uptime() keeps counting while every CPU is idle and
+// so has no clock tick.
+void
+idletick(char *s)
+{
+  int i, t0, t;
+
+  for(i = 0; i < 3; i++){
+    t0 = uptime();
+    pause(5);
+    t = uptime() - t0;
+    if(t < 4 || t > 7){
+      printf("%s: pause(5) took %d ticks\n", s, t);
+      exit(1);
+    }
+  }
+}
+
+// nice() clamps, and a child inherits its parent's value.
+void
+nicetest(char *s)
+{
+  int pid, xst;
+
+  if(nice(0) != 0 || nice(1) != 1 || nice(100) != 3 || nice(-1) != 2){
+    printf("%s: nice returned wrong value\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0)
+    exit(nice(0));
+  wait(&xst);
+  if(xst != 2 || nice(-100) != 0){
+    printf("%s: child nice %d\n", s, xst);
+    exit(1);
+  }
+}
+
+// a process pinned to one CPU stays there.
+void
+affinitytest(char *s)
+{
+  int pid, xst, i, m0;
+  uint64 mask, all;
+
+  if(sched_getaffinity(0, &all) < 0 || (all & 1) == 0){
+    printf("%s: sched_getaffinity failed\n", s);
+    exit(1);
+  }
+  if(sched_setaffinity(0, 0) != -1 || sched_setaffinity(-1, 1) != -1){
+    printf("%s: sched_setaffinity accepted a bad argument\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(sched_setaffinity(0, 1) != 0)
+      exit(1);
+    m0 = nmigrate(0);
+    if(sched_getaffinity(0, &mask) != 0 || mask != 1 || m0 < 0)
+      exit(2);
+    for(i = 0; i < 20; i++)
+      pause(1);
+    if(nmigrate(0) != m0)
+      exit(3);
+    exit(0);
+  }
+  wait(&xst);
+  if(xst != 0){
+    printf("%s: pinned child failed (%d)\n", s, xst);
+    exit(1);
+  }
+  if(sched_getaffinity(0, &mask) < 0 || mask != all){
+    printf("%s: parent affinity changed\n", s);
+    exit(1);
+  }
+}
+
+static lock_t clonelock;
+static volatile int clonecount;
+static char *volatile clonemem;
+static int clonefds[2];
+
+static void
+clonework(void *arg)
+{
+  int i, id = (int)(uint64)arg;
+
+  for(i = 0; i < 1000; i++){
+    lock_acquire(&clonelock);
+    clonecount++;
+    lock_release(&clonelock);
+  }
+  if(id == 0){
+    clonemem = sbrk(4096);
+    clonemem[0] = 'x';
+  }
+  if(id == 1 && pipe(clonefds) < 0)
+    clonefds[0] = -1;
+  texit(id + 10);
+}
+
+// threads made by clone() share memory and open files, and
+// are collected by join() but not wait().
+void
+clonetest(char *s)
+{
+  int tids[4], i, xst;
+  char c;
+
+  lock_init(&clonelock);
+  for(i = 0; i < 4; i++){
+    if((tids[i] = thread_create(clonework, (void*)(uint64)i)) < 0){
+      printf("%s: thread_create failed\n", s);
+      exit(1);
+    }
+  }
+  if(wait(0) != -1){
+    printf("%s: wait() collected a thread\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 4; i++){
+    if(thread_join(tids[i], &xst) != tids[i] || xst != i + 10){
+      printf("%s: thread_join failed\n", s);
+      exit(1);
+    }
+  }
+  if(join(0, 0) != -1){
+    printf("%s: join with no threads succeeded\n", s);
+    exit(1);
+  }
+  if(clonecount != 4000){
+    printf("%s: count %d, not 4000\n", s, clonecount);
+    exit(1);
+  }
+  if(clonemem == SBRK_ERROR || clonemem[0] != 'x'){
+    printf("%s: thread's sbrk not visible\n", s);
+    exit(1);
+  }
+  if(clonefds[0] < 0 || write(clonefds[1], "y", 1) != 1 ||
+     read(clonefds[0], &c, 1) != 1 || c != 'y'){
+    printf("%s: thread's pipe not visible\n", s);
+    exit(1);
+  }
+  close(clonefds[0]);
+  close(clonefds[1]);
+}
+
+static void
+exitwork(void *arg)
+{
+  if(arg)
+    exit(7);
+  for(;;)
+    pause(1);
+}
+
+// exit() in any thread ends the whole process with its
+// status, and kill() kills every thread.
+void
+threadexit(char *s)
+{
+  int pid, i, xst;
+
+  for(i = 0; i < 2; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      thread_create(exitwork, 0);
+      if(thread_create(exitwork, (void*)(uint64)(i == 0)) < 0)
+        exit(1);
+      for(;;)
+        pause(1);
+    }
+    if(i == 1){
+      pause(2);
+      kill(pid);
+    }
+    if(wait(&xst) != pid || xst != (i == 0 ? 7 : -1)){
+      printf("%s: process exited with %d\n", s, xst);
+      exit(1);
+    }
+  }
+}
+
+static mutex_t futexmu;
+static cond_t futexcv;
+static int futexcount, futexdone;
+static volatile uint futexword;
+
+static void
+futexwork(void *arg)
+{
+  int i;
+
+  for(i = 0; i < 1000; i++){
+    mutex_lock(&futexmu);
+    futexcount++;
+    mutex_unlock(&futexmu);
+  }
+  mutex_lock(&futexmu);
+  futexdone++;
+  cond_signal(&futexcv);
+  mutex_unlock(&futexmu);
+}
+
+static void
+futexcowwork(void *arg)
+{
+  while(futexword == 0)
+    futex(&futexword, FUTEX_WAIT, 0);
+}
+
+// futex() system call, and the mutexes and condition
+// variables built on it.
+void
+futextest(char *s)
+{
+  volatile uint w = 0;
+  int tids[4], i, pid;
+
+  if(futex(&w, FUTEX_WAIT, 1) != -1 || futex(&w, FUTEX_WAKE, 1) != 0 ||
+     futex(&w, 7, 0) != -1 || futex((uint*)((char*)&w + 1), FUTEX_WAKE, 1) != -1){
+    printf("%s: futex() misbehaved\n", s);
+    exit(1);
+  }
+
+  mutex_init(&futexmu);
+  cond_init(&futexcv);
+  for(i = 0; i < 4; i++){
+    if((tids[i] = thread_create(futexwork, 0)) < 0){
+      printf("%s: thread_create failed\n", s);
+      exit(1);
+    }
+  }
+  mutex_lock(&futexmu);
+  while(futexdone < 4)
+    cond_wait(&futexcv, &futexmu);
+  if(futexcount != 4000){
+    printf("%s: count %d, not 4000\n", s, futexcount);
+    exit(1);
+  }
+  mutex_unlock(&futexmu);
+  for(i = 0; i < 4; i++){
+    if(thread_join(tids[i], 0) != tids[i]){
+      printf("%s: thread_join failed\n", s);
+      exit(1);
+    }
+  }
+
+  // a waiter must still be found after a fork() makes its
+  // page copy-on-write and the waker's write copies it.
+  futexword = 0;
+  if((tids[0] = thread_create(futexcowwork, 0)) < 0){
+    printf("%s: thread_create failed\n", s);
+    exit(1);
+  }
+  pause(2);
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    pause(1000);
+    exit(0);
+  }
+  futexword = 1;
+  futex(&futexword, FUTEX_WAKE, 1);
+  if(thread_join(tids[0], 0) != tids[0]){
+    printf("%s: thread_join failed\n", s);
+    exit(1);
+  }
+  kill(pid);
+  wait(0);
+}
+
 // meant to be run w/ at most two CPUs
 void
 preempt(char *s)
@@ -2585,6 +3136,52 @@ badarg(char *s)
   exit(0);
 }
 
+// a heap big enough for 2MB superpages stays intact in the
+// parent while a forked child writes to it, and frees part
+// of it.
+void
+supercow(char *s)
+{
+  enum { SZ = 6*1024*1024 };
+  char *b;
+  int i, pid, xst;
+
+  b = sbrk(SZ);
+  if(b == SBRK_ERROR){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < SZ; i += PGSIZE)
+    b[i] = 1;
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(i = 0; i < SZ; i += PGSIZE){
+      if(b[i] != 1)
+        exit(1);
+      b[i] = 2;
+    }
+    if(sbrk(-(SZ/2 + 3*PGSIZE)) == SBRK_ERROR || b[0] != 2)
+      exit(2);
+    exit(0);
+  }
+  wait(&xst);
+  if(xst != 0){
+    printf("%s: child failed (%d)\n", s, xst);
+    exit(1);
+  }
+  for(i = 0; i < SZ; i += PGSIZE){
+    if(b[i] != 1){
+      printf("%s: child's write reached the parent\n", s);
+      exit(1);
+    }
+  }
+  sbrk(-SZ);
+}
+
 #define REGION_SZ (1024 * 1024 * 1024)
 
 // Touch a page every 64 pages, which with lazy allocation
@@ -2720,8 +3317,19 @@ struct test {
   {createtest, "createtest"},
   {dirtest, "dirtest"},
   {exectest, "exectest"},
+  {spawntest, "spawntest"},
+  {mmaptest, "mmaptest"},
+  {shmtest, "shmtest"},
+  {lazyexec, "lazyexec"},
   {pipe1, "pipe1"},
   {killstatus, "killstatus"},
+  {sleeptest, "sleeptest"},
+  {idletick, "idletick"},
+  {nicetest, "nicetest"},
+  {affinitytest, "affinitytest"},
+  {clonetest, "clonetest"},
+  {threadexit, "threadexit"},
+  {futextest, "futextest"},
   {preempt, "preempt"},
   {exitwait, "exitwait"},
   {reparent, "reparent" },
@@ -2747,6 +3355,7 @@ struct test {
   {forktest, "forktest"},
   {sbrkbasic, "sbrkbasic"},
   {sbrkmuch, "sbrkmuch"},
+  {supercow, "supercow"},
   {kernmem, "kernmem"},
   {MAXVAplus, "MAXVAplus"},
   {sbrkfail, "sbrkfail"},
@@ -42,3 +42,15 @@ entry("getpid");
 entry("sbrk");
 entry("pause");
 entry("uptime");
+entry("spawn");
+entry("mmap");
+entry("munmap");
+entry("nanosleep");
+entry("nice");
+entry("sched_setaffinity");
+entry("sched_getaffinity");
+entry("clone");
+entry("join");
+entry("futex");
+entry("texit");
+entry("nmigrate");